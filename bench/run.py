@@ -0,0 +1,250 @@
+"""
+Whole-program benchmarks for clox and jlox.
+
+Runs every bench/*.lox program, plus a couple of large generated
+sources that mostly measure compile speed, on each interpreter: a few
+warmup runs first, then timed repetitions. It reports the median, p95
+and variance of the wall-clock times and compares the medians with a
+JSON baseline, by default the previous run's.
+
+    # From the repository root, after building clox (and jlox)
+    python3 bench/run.py
+    python3 bench/run.py --runs 20 --filter string
+    python3 bench/run.py --interpreters clox --baseline before.json
+
+The programs only use what both interpreters understand: no functions
+or classes, which clox doesn't have yet.
+"""
+
+import argparse
+import json
+import math
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from datetime import datetime, timezone
+from pathlib import Path
+
+BENCH_DIR = Path(__file__).resolve().parent
+ROOT_DIR = BENCH_DIR.parent
+LAST_RUN = BENCH_DIR / "baselines" / "last.json"
+
+
+# Generated sources ---------------------------------------------------------
+
+
+def generate_large(path: Path):
+    """About 4 MB of straight-line code on a few locals, with comments.
+
+    Every literal and global name takes a constant slot and a chunk
+    only has 256, so the statements stick to locals.
+    """
+    lines = ["// Generated: a large script for compile speed", "{"]
+    lines.append("    var a = 1; var b = 2; var c = 3; var d = 4;")
+    for i in range(100000):
+        if i % 10 == 0:
+            lines.append(f"    // Statement group {i // 10}, nothing to see here")
+        lines.append("    a = a + b * (c - d) / (b + c);  d = -a + c;  c = c * b - d;")
+    lines.append("    print a;")
+    lines.append("}")
+    path.write_text("\n".join(lines) + "\n")
+
+
+def generate_nested(path: Path):
+    """Blocks nested 100 deep with a local and a branch at each level."""
+
+    depth = 100
+    lines = ["// Generated: deeply nested scopes for compile speed", "{", "    var n = 0;"]
+    for _ in range(300):
+        for level in range(depth):
+            indent = "    " * (level + 1)
+            lines.append(f"{indent}{{ var v{level} = n;")
+            lines.append(f"{indent}if (v{level} < n) n = n - v{level}; else n = n + v{level};")
+        lines.append("    " * (depth + 1) + "}" * depth)
+    lines.append("    print n;")
+    lines.append("}")
+    path.write_text("\n".join(lines) + "\n")
+
+
+GENERATED = {
+    "compile_large": generate_large,
+    "compile_nested": generate_nested,
+}
+
+
+# Interpreters --------------------------------------------------------------
+
+
+def clox_command(args):
+    binary = Path(args.clox).resolve()
+    if not binary.exists():
+        return None, f"{binary} not found, build it with `make` in clox/"
+    return [str(binary)], None
+
+
+def jlox_command(args):
+    java = shutil.which("java")
+    if java is None:
+        return None, "no java on PATH"
+
+    jlox_dir = ROOT_DIR / "jlox"
+    main_class = jlox_dir / "com" / "craftinginterpreters" / "lox" / "Lox.class"
+    if not main_class.exists():
+        javac = shutil.which("javac")
+        if javac is None:
+            return None, "jlox isn't compiled and there is no javac on PATH"
+        subprocess.run([javac, "com/craftinginterpreters/lox/Lox.java"], cwd=jlox_dir, check=True)
+
+    return [java, "-cp", str(jlox_dir), "com.craftinginterpreters.lox.Lox"], None
+
+
+INTERPRETERS = {
+    "clox": clox_command,
+    "jlox": jlox_command,
+}
+
+
+# Measuring -----------------------------------------------------------------
+
+
+def time_once(command: list, script: Path):
+    start = time.perf_counter()
+    result = subprocess.run(command + [str(script)], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    elapsed = time.perf_counter() - start
+    if result.returncode != 0:
+        message = result.stderr.decode(errors="replace").strip().splitlines()
+        raise RuntimeError(f"exit status {result.returncode}: {message[-1] if message else ''}")
+    return elapsed
+
+
+def percentile(samples: list, fraction: float):
+    """Nearest-rank percentile."""
+    ordered = sorted(samples)
+    return ordered[max(0, math.ceil(fraction * len(ordered)) - 1)]
+
+
+def summarize(samples: list):
+    return {
+        "samples": samples,
+        "min": min(samples),
+        "mean": statistics.fmean(samples),
+        "median": statistics.median(samples),
+        "p95": percentile(samples, 0.95),
+        "variance": statistics.variance(samples) if len(samples) > 1 else 0.0,
+    }
+
+
+def measure(command: list, script: Path, warmup: int, runs: int):
+    for _ in range(warmup):
+        time_once(command, script)
+    return summarize([time_once(command, script) for _ in range(runs)])
+
+
+# Reporting -----------------------------------------------------------------
+
+
+def compare(current: dict, previous: dict, threshold: float):
+    """Change of the median against `previous`, and whether it stands
+    out of both the threshold and the noise of the two runs."""
+    if previous is None:
+        return ""
+
+    change = current["median"] / previous["median"] - 1
+    noise = 2 * math.sqrt(current["variance"] / len(current["samples"]) +
+                          previous["variance"] / len(previous["samples"]))
+    verdict = ""
+    if abs(change) > threshold and abs(current["median"] - previous["median"]) > noise:
+        verdict = " slower" if change > 0 else " faster"
+    return f"{change * 100:+7.1f}%{verdict}"
+
+
+def report(results: dict, baseline: dict, threshold: float):
+    previous = baseline["results"] if baseline else {}
+    print(f"{'benchmark':<18} {'interp':<6} {'median ms':>10} {'p95 ms':>10} {'stdev ms':>9}  vs baseline")
+    for key, result in results.items():
+        interpreter, name = key.split("/", 1)
+        if "error" in result:
+            print(f"{name:<18} {interpreter:<6} {result['error']}")
+            continue
+        old = previous.get(key)
+        old = old if old and "error" not in old else None
+        print(f"{name:<18} {interpreter:<6} {result['median'] * 1000:10.1f} {result['p95'] * 1000:10.1f} "
+              f"{math.sqrt(result['variance']) * 1000:9.2f}  {compare(result, old, threshold)}")
+
+
+def load(path: Path):
+    if not path.exists():
+        return None
+    with open(path) as file:
+        return json.load(file)
+
+
+def save(path: Path, document: dict):
+    path.parent.mkdir(parents=True, exist_ok=True)
+    with open(path, "w") as file:
+        json.dump(document, file, indent=2)
+        file.write("\n")
+
+
+# Main ----------------------------------------------------------------------
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark clox and jlox on bench/*.lox")
+    parser.add_argument("--interpreters", default="clox,jlox", help="comma separated, default: clox,jlox")
+    parser.add_argument("--clox", default=str(ROOT_DIR / "clox" / "main"), help="path to the clox binary")
+    parser.add_argument("--warmup", type=int, default=2, help="untimed runs first, default: 2")
+    parser.add_argument("--runs", type=int, default=10, help="timed runs, default: 10")
+    parser.add_argument("--filter", default="", help="only benchmarks whose name contains this")
+    parser.add_argument("--threshold", type=float, default=5.0, help="percent change worth flagging, default: 5")
+    parser.add_argument("--baseline", type=Path, default=LAST_RUN, help="results to compare with")
+    parser.add_argument("--save", type=Path, default=LAST_RUN, help="where to store the results")
+    parser.add_argument("--no-save", action="store_true", help="don't store the results")
+    args = parser.parse_args()
+
+    if args.runs < 1:
+        parser.error("--runs must be at least 1")
+
+    with tempfile.TemporaryDirectory() as scratch:
+        scripts = {path.stem: path for path in sorted(BENCH_DIR.glob("*.lox"))}
+        for name, generate in GENERATED.items():
+            scripts[name] = Path(scratch) / f"{name}.lox"
+            generate(scripts[name])
+        scripts = {name: path for name, path in scripts.items() if args.filter in name}
+
+        results = {}
+        for interpreter in args.interpreters.split(","):
+            if interpreter not in INTERPRETERS:
+                parser.error(f"unknown interpreter {interpreter}")
+            command, problem = INTERPRETERS[interpreter](args)
+            if command is None:
+                print(f"Skipping {interpreter}: {problem}", file=sys.stderr)
+                continue
+
+            for name, script in scripts.items():
+                key = f"{interpreter}/{name}"
+                try:
+                    results[key] = measure(command, script, args.warmup, args.runs)
+                except RuntimeError as error:
+                    results[key] = {"error": str(error)}
+
+    baseline = load(args.baseline)
+    report(results, baseline, args.threshold / 100)
+
+    if not args.no_save:
+        save(args.save, {
+            "created": datetime.now(timezone.utc).isoformat(timespec="seconds"),
+            "host": platform.node(),
+            "warmup": args.warmup,
+            "runs": args.runs,
+            "results": results,
+        })
+
+
+if __name__ == "__main__":
+    main()
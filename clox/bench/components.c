@@ -0,0 +1,609 @@
+#define _POSIX_C_SOURCE 199309L
+
+/*
+Microbenchmarks for the pieces whole-script benchmarks blur together:
+
+- table: tableSet / tableGet / tableDelete over a range of key counts,
+  and delete-and-reinsert churn at several delete ratios
+- intern: copyString, and reserveString filled in place and passed to
+  internString, hitting the VM's cache or interning new strings
+- scanner: scanToken over generated code
+- chunk: writeChunk growing a chunk byte by byte
+- memory: reallocate, allocating and freeing, and growing a block
+
+Every case runs a few warmup trials and then TRIALS timed ones. The
+report gives the median cost per operation in nanoseconds and in time
+stamp counter cycles, with the median absolute deviation across the
+trials as the noise, and the best trial.
+
+    ./bench/components [--filter=TEXT] [--save=FILE] [--compare=FILE] [--threshold=PCT]
+
+--save writes the medians to FILE. --compare reads such a file and
+flags every case that got slower by more than the threshold (5% by
+default) and by more than three times the noise, exiting with status
+1 if any did. Build with `make bench`.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "chunk.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+#define WARMUP 2
+#define TRIALS 15
+#define MAX_CASES 64
+
+static volatile uint64_t sink;
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)(nowSeconds() * 1e9);
+#endif
+}
+
+// Timing --------------------------------------------------------------------
+
+// One trial: the case does its setup, then brackets the part worth
+// timing with startTrial() and stopTrial()
+typedef struct
+{
+    double start;
+    uint64_t startCycles;
+    double seconds;
+    uint64_t cycles;
+} Trial;
+
+static void startTrial(Trial *trial)
+{
+    trial->start = nowSeconds();
+    trial->startCycles = cycles();
+}
+
+static void stopTrial(Trial *trial)
+{
+    trial->cycles = cycles() - trial->startCycles;
+    trial->seconds = nowSeconds() - trial->start;
+}
+
+typedef struct
+{
+    int size;  // Keys, strings or bytes
+    int ratio; // Percent of keys deleted per round, for churn
+} Params;
+
+typedef void (*TrialFn)(Trial *trial, const Params *params);
+
+typedef struct
+{
+    char name[48];
+    double median; // ns per op
+    double mad;    // ns per op
+    double best;   // ns per op
+    double cyclesPerOp;
+} Result;
+
+static Result results[MAX_CASES];
+static int resultCount;
+static const char *filter = "";
+
+static int byValue(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int count)
+{
+    qsort(values, count, sizeof(double), byValue);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/*
+Params
+------
+- name: case name, printed and used as the key in saved results
+- ops: operations one trial performs, to report costs per operation
+*/
+static void measure(const char *name, long ops, TrialFn trial, Params params)
+{
+    if (strstr(name, filter) == NULL || resultCount == MAX_CASES)
+        return;
+
+    Trial t;
+    for (int i = 0; i < WARMUP; i++)
+        trial(&t, &params);
+
+    double ns[TRIALS], perOpCycles[TRIALS], deviations[TRIALS];
+    for (int i = 0; i < TRIALS; i++)
+    {
+        trial(&t, &params);
+        ns[i] = t.seconds * 1e9 / ops;
+        perOpCycles[i] = (double)t.cycles / ops;
+    }
+
+    Result *result = &results[resultCount++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->median = median(ns, TRIALS);
+    result->best = ns[0]; // median() sorted them
+    for (int i = 0; i < TRIALS; i++)
+        deviations[i] = ns[i] > result->median ? ns[i] - result->median : result->median - ns[i];
+    result->mad = median(deviations, TRIALS);
+    result->cyclesPerOp = median(perOpCycles, TRIALS);
+
+    printf("%-28s %10ld %10.2f %10.1f %8.1f%% %10.2f\n", name, ops, result->median, result->cyclesPerOp,
+           result->median == 0 ? 0 : 100 * result->mad / result->median, result->best);
+    fflush(stdout);
+}
+
+// Keys ----------------------------------------------------------------------
+
+// Strings that belong to no VM, enough for a Table
+static ObjString **makeKeys(int count, const char *prefix)
+{
+    ObjString **keys = malloc(sizeof(ObjString *) * count);
+    char chars[32];
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(chars, sizeof(chars), "%s%d", prefix, i);
+        keys[i] = reserveString(length);
+        memcpy(keys[i]->chars, chars, length);
+        keys[i]->hash = hashString(chars, length);
+    }
+    return keys;
+}
+
+static void freeKeys(ObjString **keys, int count)
+{
+    for (int i = 0; i < count; i++)
+        freeObject((Obj *)keys[i]);
+    free(keys);
+}
+
+// The strings were allocated one after the other, shuffled so walking
+// the array doesn't walk memory in order too
+static void shuffle(ObjString **keys, int count)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (int i = count - 1; i > 0; i--)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        int j = (int)((state >> 33) % (uint64_t)(i + 1));
+        ObjString *swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+}
+
+// Table ---------------------------------------------------------------------
+
+// Operations per trial, so small tables are filled many times over
+static long tableOps(int size)
+{
+    return size >= 1 << 20 ? size : (long)size * ((1 << 20) / size);
+}
+
+// Built once per key count, making a million strings takes longer
+// than any trial
+static ObjString **keys;
+static ObjString **missing;
+
+static void tableSetTrial(Trial *trial, const Params *params)
+{
+    long rounds = tableOps(params->size) / params->size;
+    Table tables[64];
+    int batch = rounds < 64 ? (int)rounds : 64;
+
+    // Tables are freed outside the timed part, a batch at a time
+    trial->seconds = 0;
+    trial->cycles = 0;
+    for (long done = 0; done < rounds; done += batch)
+    {
+        Trial part;
+        for (int t = 0; t < batch; t++)
+            initTable(&tables[t]);
+        startTrial(&part);
+        for (int t = 0; t < batch; t++)
+            for (int i = 0; i < params->size; i++)
+                tableSet(&tables[t], keys[i], NUMBER_VAL(i));
+        stopTrial(&part);
+        for (int t = 0; t < batch; t++)
+            freeTable(&tables[t]);
+        trial->seconds += part.seconds;
+        trial->cycles += part.cycles;
+    }
+}
+
+static void tableGetTrial(Trial *trial, const Params *params)
+{
+    // ratio 100 looks up keys that are all there, 0 ones that aren't
+    ObjString **lookups = params->ratio == 100 ? keys : missing;
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < params->size; i++)
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+
+    long rounds = tableOps(params->size) / params->size;
+    Value value = NIL_VAL;
+    int found = 0;
+    startTrial(trial);
+    for (long r = 0; r < rounds; r++)
+        for (int i = 0; i < params->size; i++)
+            found += tableGet(&table, lookups[i], &value);
+    stopTrial(trial);
+    sink = found;
+
+    freeTable(&table);
+}
+
+static long churnRounds(int size, int victims)
+{
+    long rounds = tableOps(size) / (2L * victims);
+    return rounds < 1 ? 1 : rounds;
+}
+
+// Delete `ratio` percent of the keys and put them back, over and
+// over, which leaves tombstones for the table to deal with
+static void tableChurnTrial(Trial *trial, const Params *params)
+{
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < params->size; i++)
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+
+    int victims = params->size * params->ratio / 100;
+    long rounds = churnRounds(params->size, victims);
+    startTrial(trial);
+    for (long r = 0; r < rounds; r++)
+    {
+        int first = (int)((r * victims) % params->size);
+        for (int i = 0; i < victims; i++)
+            tableDelete(&table, keys[(first + i) % params->size]);
+        for (int i = 0; i < victims; i++)
+            tableSet(&table, keys[(first + i) % params->size], NUMBER_VAL(i));
+    }
+    stopTrial(trial);
+
+    freeTable(&table);
+}
+
+static void benchTables()
+{
+    static const int sizes[] = {16, 1024, 65536, 1 << 20};
+    static const int ratios[] = {10, 50, 90};
+    char name[48];
+
+    for (int i = 0; i < 4; i++)
+    {
+        int size = sizes[i];
+        keys = makeKeys(size, "key");
+        missing = makeKeys(size, "absent");
+        shuffle(keys, size);
+
+        snprintf(name, sizeof(name), "table/set/%d", size);
+        measure(name, tableOps(size), tableSetTrial, (Params){size, 0});
+        snprintf(name, sizeof(name), "table/get-hit/%d", size);
+        measure(name, tableOps(size), tableGetTrial, (Params){size, 100});
+        snprintf(name, sizeof(name), "table/get-miss/%d", size);
+        measure(name, tableOps(size), tableGetTrial, (Params){size, 0});
+
+        for (int j = 0; j < 3; j++)
+        {
+            int victims = size * ratios[j] / 100;
+            snprintf(name, sizeof(name), "table/churn-%d%%/%d", ratios[j], size);
+            measure(name, churnRounds(size, victims) * 2 * victims, tableChurnTrial, (Params){size, ratios[j]});
+        }
+
+        freeKeys(keys, size);
+        freeKeys(missing, size);
+    }
+}
+
+// Interning -----------------------------------------------------------------
+
+#define INTERN_STRINGS 200000
+
+static char **makeTexts(int count, int length)
+{
+    char **texts = malloc(sizeof(char *) * count);
+    for (int i = 0; i < count; i++)
+    {
+        texts[i] = malloc(length + 1);
+        int written = snprintf(texts[i], length + 1, "%0*d", length, i);
+        (void)written;
+    }
+    return texts;
+}
+
+static void freeTexts(char **texts, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(texts[i]);
+    free(texts);
+}
+
+// size is the string length, ratio 100 for strings the VM has seen
+static void copyStringTrial(Trial *trial, const Params *params)
+{
+    char **texts = makeTexts(INTERN_STRINGS, params->size);
+    VM vm;
+    initVM(&vm);
+    if (params->ratio == 100)
+        for (int i = 0; i < INTERN_STRINGS; i++)
+            copyString(&vm, texts[i], params->size);
+
+    startTrial(trial);
+    for (int i = 0; i < INTERN_STRINGS; i++)
+        sink += (uintptr_t)copyString(&vm, texts[i], params->size);
+    stopTrial(trial);
+
+    freeVM(&vm);
+    freeTexts(texts, INTERN_STRINGS);
+}
+
+static void reserveStringTrial(Trial *trial, const Params *params)
+{
+    char **texts = makeTexts(INTERN_STRINGS, params->size);
+    VM vm;
+    initVM(&vm);
+    if (params->ratio == 100)
+        for (int i = 0; i < INTERN_STRINGS; i++)
+            copyString(&vm, texts[i], params->size);
+
+    // The way concatenation and read() build their strings
+    startTrial(trial);
+    for (int i = 0; i < INTERN_STRINGS; i++)
+    {
+        ObjString *string = reserveString(params->size);
+        memcpy(string->chars, texts[i], params->size);
+        sink += (uintptr_t)internString(&vm, string);
+    }
+    stopTrial(trial);
+
+    freeVM(&vm);
+    freeTexts(texts, INTERN_STRINGS);
+}
+
+static void benchInterning()
+{
+    static const int lengths[] = {16, 64};
+    char name[48];
+    for (int i = 0; i < 2; i++)
+    {
+        snprintf(name, sizeof(name), "intern/copy-hit/%d", lengths[i]);
+        measure(name, INTERN_STRINGS, copyStringTrial, (Params){lengths[i], 100});
+        snprintf(name, sizeof(name), "intern/copy-new/%d", lengths[i]);
+        measure(name, INTERN_STRINGS, copyStringTrial, (Params){lengths[i], 0});
+        snprintf(name, sizeof(name), "intern/reserve-hit/%d", lengths[i]);
+        measure(name, INTERN_STRINGS, reserveStringTrial, (Params){lengths[i], 100});
+        snprintf(name, sizeof(name), "intern/reserve-new/%d", lengths[i]);
+        measure(name, INTERN_STRINGS, reserveStringTrial, (Params){lengths[i], 0});
+    }
+}
+
+// Scanner -------------------------------------------------------------------
+
+#define SCANNER_LINES 20000
+
+static const char *scannerLine = "    if (total_12 >= 10.5 and name != \"label\") total_12 = total_12 + i * 2; // x\n";
+static char *scannerSource;
+static long scannerTokens;
+
+static void scanTrial(Trial *trial, const Params *params)
+{
+    (void)params;
+    Scanner scanner;
+    long tokens = 0;
+    startTrial(trial);
+    initScanner(&scanner, scannerSource);
+    while (scanToken(&scanner).type != TOKEN_EOF)
+        tokens++;
+    stopTrial(trial);
+    scannerTokens = tokens;
+}
+
+static void benchScanner()
+{
+    size_t length = strlen(scannerLine);
+    scannerSource = malloc(length * SCANNER_LINES + 1);
+    for (int i = 0; i < SCANNER_LINES; i++)
+        memcpy(scannerSource + i * length, scannerLine, length);
+    scannerSource[length * SCANNER_LINES] = '\0';
+
+    // Count the tokens once to report per token
+    Trial trial;
+    scanTrial(&trial, NULL);
+    measure("scanner/scanToken", scannerTokens, scanTrial, (Params){0, 0});
+    free(scannerSource);
+}
+
+// Chunks and memory ---------------------------------------------------------
+
+#define CHUNK_BYTES (4 * 1024 * 1024)
+
+static void writeChunkTrial(Trial *trial, const Params *params)
+{
+    (void)params;
+    Chunk chunk;
+    initChunk(&chunk);
+    startTrial(trial);
+    for (int i = 0; i < CHUNK_BYTES; i++)
+        writeChunk(&chunk, (uint8_t)i, i >> 4);
+    stopTrial(trial);
+    freeChunk(&chunk);
+}
+
+#define ALLOCATIONS (1 << 20)
+
+static void reallocateTrial(Trial *trial, const Params *params)
+{
+    // Keep a window of blocks alive so the allocator can't just hand
+    // the last one back every time
+    void *live[64] = {NULL};
+    startTrial(trial);
+    for (int i = 0; i < ALLOCATIONS; i++)
+    {
+        void **slot = &live[i & 63];
+        reallocate(*slot, *slot == NULL ? 0 : (size_t)params->size, 0);
+        *slot = reallocate(NULL, 0, params->size);
+    }
+    stopTrial(trial);
+    for (int i = 0; i < 64; i++)
+        reallocate(live[i], params->size, 0);
+}
+
+// Doubling a block the way GROW_ARRAY does, up to `size` bytes
+static void growTrial(Trial *trial, const Params *params)
+{
+    long grows = 0;
+    startTrial(trial);
+    for (int round = 0; round < 1000; round++)
+    {
+        size_t capacity = 0;
+        void *block = NULL;
+        while (capacity < (size_t)params->size)
+        {
+            size_t next = GROW_CAPACITY(capacity);
+            block = reallocate(block, capacity, next);
+            ((char *)block)[next - 1] = 0;
+            capacity = next;
+            grows++;
+        }
+        reallocate(block, capacity, 0);
+    }
+    stopTrial(trial);
+    sink = grows;
+}
+
+static void benchMemory()
+{
+    measure("chunk/writeChunk", CHUNK_BYTES, writeChunkTrial, (Params){0, 0});
+
+    static const int sizes[] = {16, 64, 1024};
+    char name[48];
+    for (int i = 0; i < 3; i++)
+    {
+        snprintf(name, sizeof(name), "memory/alloc-free/%d", sizes[i]);
+        measure(name, ALLOCATIONS, reallocateTrial, (Params){sizes[i], 0});
+    }
+
+    // 8 bytes doubled up to 1 MB is 18 reallocations
+    measure("memory/grow/1M", 1000 * 18, growTrial, (Params){1 << 20, 0});
+}
+
+// Baselines -----------------------------------------------------------------
+
+static bool save(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    for (int i = 0; i < resultCount; i++)
+        fprintf(file, "%s %.4f %.4f\n", results[i].name, results[i].median, results[i].mad);
+    return fclose(file) == 0;
+}
+
+// Returns the number of regressions, or -1 if the file can't be read
+static int compare(const char *path, double threshold)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    int regressions = 0;
+    char name[48];
+    double median, mad;
+    printf("\n%-28s %10s %10s %9s\n", "compared with baseline", "before", "after", "change");
+    while (fscanf(file, "%47s %lf %lf", name, &median, &mad) == 3)
+    {
+        for (int i = 0; i < resultCount; i++)
+        {
+            Result *result = &results[i];
+            if (strcmp(result->name, name) != 0)
+                continue;
+
+            double change = median == 0 ? 0 : result->median / median - 1;
+            double noise = 3 * (result->mad > mad ? result->mad : mad);
+            const char *verdict = "";
+            if (change > threshold && result->median - median > noise)
+            {
+                verdict = " REGRESSION";
+                regressions++;
+            }
+            else if (change < -threshold && median - result->median > noise)
+                verdict = " faster";
+
+            printf("%-28s %10.2f %10.2f %+8.1f%%%s\n", name, median, result->median, change * 100, verdict);
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *savePath = NULL, *comparePath = NULL;
+    double threshold = 0.05;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--filter=", 9) == 0)
+            filter = argv[i] + 9;
+        else if (strncmp(argv[i], "--save=", 7) == 0)
+            savePath = argv[i] + 7;
+        else if (strncmp(argv[i], "--compare=", 10) == 0)
+            comparePath = argv[i] + 10;
+        else if (strncmp(argv[i], "--threshold=", 12) == 0)
+            threshold = atof(argv[i] + 12) / 100;
+        else
+        {
+            fprintf(stderr, "Usage: components [--filter=TEXT] [--save=FILE] [--compare=FILE] [--threshold=PCT]\n");
+            return 64;
+        }
+    }
+
+    printf("%-28s %10s %10s %10s %9s %10s\n", "case", "ops", "ns/op", "cycles/op", "noise", "best ns");
+    benchTables();
+    benchInterning();
+    benchScanner();
+    benchMemory();
+
+    if (savePath != NULL && !save(savePath))
+    {
+        fprintf(stderr, "Cannot write file \"%s\".\n", savePath);
+        return 74;
+    }
+
+    if (comparePath != NULL)
+    {
+        int regressions = compare(comparePath, threshold);
+        if (regressions < 0)
+        {
+            fprintf(stderr, "Cannot read file \"%s\".\n", comparePath);
+            return 74;
+        }
+        if (regressions > 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 199309L
+
+/*
+Throughput of the string hashes over a range of lengths:
+
+- fnv1a: the byte-at-a-time hash clox used to have, for reference
+- fast: the default, see fastHash()
+- sip: the keyed mode, see sipHash()
+
+Build with `make bench` and run ./bench/hash.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define TOTAL_BYTES (256 * 1024 * 1024)
+
+static volatile uint64_t sink;
+
+static uint64_t fnv1a(const void *key, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 2166136261u ^ (uint32_t)seed;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static const uint64_t secret[2] = {0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull};
+
+static uint64_t sip(const void *key, size_t length, uint64_t seed)
+{
+    (void)seed;
+    return sipHash(key, length, secret);
+}
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash the same buffer over and over, feeding every result into the
+// next seed so the calls can't be overlapped or hoisted
+static void run(const char *name, uint64_t (*hash)(const void *, size_t, uint64_t), const char *data, size_t length)
+{
+    long rounds = TOTAL_BYTES / (long)length;
+    if (rounds > 20 * 1000 * 1000)
+        rounds = 20 * 1000 * 1000;
+
+    uint64_t seed = 0;
+    double start = nowSeconds();
+    for (long i = 0; i < rounds; i++)
+        seed = hash(data, length, seed & 1);
+    double elapsed = nowSeconds() - start;
+    sink = seed;
+
+    printf("%-6s %6zu %10.2f ns %10.1f MB/s\n", name, length,
+           elapsed * 1e9 / rounds, (double)length * rounds / elapsed / 1e6);
+}
+
+int main(void)
+{
+    static const size_t lengths[] = {3, 8, 16, 32, 64, 256, 4096};
+    char *data = malloc(4096);
+    for (int i = 0; i < 4096; i++)
+        data[i] = (char)('a' + i % 26);
+
+    printf("%-6s %6s %13s %15s\n", "hash", "bytes", "per call", "throughput");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        run("fnv1a", fnv1a, data, lengths[i]);
+        run("fast", fastHash, data, lengths[i]);
+        run("sip", sip, data, lengths[i]);
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 199309L
+
+/*
+Scanner throughput on large generated sources:
+
+- code: indented statements, the shape of a typical script
+- comments: the same code under a pile of line and block comments
+- strings: long string literals, some spanning several lines
+- numbers: a data table of number literals, whose values the scanner
+  works out as well
+
+Each source is about 16 MB and is scanned a few times, keeping the
+best run. Build with `make bench` and run ./bench/scanner.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+#define SOURCE_BYTES (16 * 1024 * 1024)
+#define ROUNDS 5
+
+typedef struct
+{
+    char *chars;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void append(Buffer *buffer, const char *text)
+{
+    size_t length = strlen(text);
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        buffer->capacity = (buffer->length + length + 1) * 2;
+        buffer->chars = realloc(buffer->chars, buffer->capacity);
+    }
+    memcpy(buffer->chars + buffer->length, text, length + 1);
+    buffer->length += length;
+}
+
+static void appendCode(Buffer *buffer, int i)
+{
+    char line[256];
+    snprintf(line, sizeof(line),
+             "{\n"
+             "    var total_%d = 0;\n"
+             "    for (var i = 0; i < %d; i = i + 1) {\n"
+             "        if (i > 10 and total_%d != nil) total_%d = total_%d + i * 2.5;\n"
+             "        else print \"small\";\n"
+             "    }\n"
+             "}\n",
+             i, i % 1000, i, i, i);
+    append(buffer, line);
+}
+
+static char *generate(const char *kind)
+{
+    Buffer buffer = {NULL, 0, 0};
+    for (int i = 0; buffer.length < SOURCE_BYTES; i++)
+    {
+        if (strcmp(kind, "comments") == 0)
+        {
+            append(&buffer, "// Add up the numbers below some bound, skipping the first few\n");
+            append(&buffer, "/*\n    Nothing in here is code: the scanner has to find the end\n"
+                            "    of the comment and count the lines on the way there.\n*/\n");
+        }
+        else if (strcmp(kind, "strings") == 0)
+        {
+            append(&buffer, "var s = \"a string literal long enough to be worth a few vector steps\";\n");
+            append(&buffer, "print \"one that\n    goes on over\n    several lines\";\n");
+        }
+        else if (strcmp(kind, "numbers") == 0)
+        {
+            char line[256];
+            snprintf(line, sizeof(line), "row(%d, %d.%03d, 0.%06d, %d.5, 3.141592653589793, 0.1);\n",
+                     i, i % 977, i % 1000, (i * 7919) % 1000000, i * 31);
+            append(&buffer, line);
+            continue;
+        }
+        appendCode(&buffer, i);
+    }
+    return buffer.chars;
+}
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *kind)
+{
+    char *source = generate(kind);
+    size_t length = strlen(source);
+    double best = 1e30;
+    long tokens = 0;
+    int lines = 0;
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        Scanner scanner;
+        double start = nowSeconds();
+        initScanner(&scanner, source);
+        tokens = 0;
+        for (;;)
+        {
+            Token token = scanToken(&scanner);
+            tokens++;
+            if (token.type == TOKEN_EOF)
+                break;
+        }
+        double elapsed = nowSeconds() - start;
+        if (elapsed < best)
+            best = elapsed;
+        lines = scanner.line;
+    }
+
+    printf("%-9s %8.1f MB %9ld tokens %8d lines %8.1f MB/s %7.1f Mtok/s\n", kind, length / 1e6,
+           tokens, lines, length / best / 1e6, tokens / best / 1e6);
+    free(source);
+}
+
+int main(void)
+{
+    run("code");
+    run("comments");
+    run("strings");
+    run("numbers");
+    return 0;
+}
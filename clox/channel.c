@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "channel.h"
+#include "intern.h"
+#include "memory.h"
+
+typedef struct
+{
+    Message *messages; // Ring buffer of `capacity` slots
+    int head;
+    int count;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} Queue;
+
+struct Channel
+{
+    pthread_mutex_t lock;
+    Queue queues[2]; // queues[side] holds what `side` sent
+    int capacity;
+    bool closed;
+    int refs;
+};
+
+Channel *openChannel(int capacity)
+{
+    Channel *channel = ALLOCATE(Channel, 1);
+    pthread_mutex_init(&channel->lock, NULL);
+    channel->capacity = capacity;
+    channel->closed = false;
+    channel->refs = 1;
+
+    for (int side = 0; side < 2; side++)
+    {
+        Queue *queue = &channel->queues[side];
+        queue->messages = ALLOCATE(Message, capacity);
+        queue->head = 0;
+        queue->count = 0;
+        pthread_cond_init(&queue->notEmpty, NULL);
+        pthread_cond_init(&queue->notFull, NULL);
+    }
+    return channel;
+}
+
+void retainChannel(Channel *channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->refs++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void releaseChannel(Channel *channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    int refs = --channel->refs;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (refs > 0)
+        return;
+
+    for (int side = 0; side < 2; side++)
+    {
+        // Nobody can receive these anymore
+        Queue *queue = &channel->queues[side];
+        for (int i = 0; i < queue->count; i++)
+            freeMessage(&queue->messages[(queue->head + i) % channel->capacity]);
+
+        FREE_ARRAY(Message, queue->messages, channel->capacity);
+        pthread_cond_destroy(&queue->notFull);
+        pthread_cond_destroy(&queue->notEmpty);
+    }
+
+    pthread_mutex_destroy(&channel->lock);
+    FREE(Channel, channel);
+}
+
+// Wake up everyone blocked on the channel. Receivers drain what is
+// left and then see the close, senders fail right away.
+void closeChannel(Channel *channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    for (int side = 0; side < 2; side++)
+    {
+        pthread_cond_broadcast(&channel->queues[side].notEmpty);
+        pthread_cond_broadcast(&channel->queues[side].notFull);
+    }
+    pthread_mutex_unlock(&channel->lock);
+}
+
+// Blocks while the queue is full. On success the channel takes
+// ownership of the message, otherwise the caller keeps it.
+bool channelSend(Channel *channel, int side, Message message)
+{
+    Queue *queue = &channel->queues[side];
+
+    pthread_mutex_lock(&channel->lock);
+    while (!channel->closed && queue->count == channel->capacity)
+        pthread_cond_wait(&queue->notFull, &channel->lock);
+
+    if (channel->closed)
+    {
+        pthread_mutex_unlock(&channel->lock);
+        return false;
+    }
+
+    queue->messages[(queue->head + queue->count) % channel->capacity] = message;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&channel->lock);
+    return true;
+}
+
+// Blocks while the other side has sent nothing. Returns false once
+// the channel is closed and drained.
+bool channelReceive(Channel *channel, int side, Message *message)
+{
+    Queue *queue = &channel->queues[1 - side];
+
+    pthread_mutex_lock(&channel->lock);
+    while (!channel->closed && queue->count == 0)
+        pthread_cond_wait(&queue->notEmpty, &channel->lock);
+
+    if (queue->count == 0)
+    {
+        pthread_mutex_unlock(&channel->lock);
+        return false;
+    }
+
+    *message = queue->messages[queue->head];
+    queue->head = (queue->head + 1) % channel->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&channel->lock);
+    return true;
+}
+
+void freeMessage(Message *message)
+{
+    switch (message->type)
+    {
+    case MSG_STRING:
+        releaseString(message->as.string);
+        break;
+    case MSG_CHANNEL:
+        releaseChannel(message->as.endpoint.channel);
+        break;
+    default:
+        break;
+    }
+    message->type = MSG_NIL;
+}
@@ -0,0 +1,51 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include "common.h"
+#include "value.h"
+
+// A duplex, bounded and thread-safe link between two endpoints,
+// side 0 and side 1. Each side sends into its own queue and
+// receives from the other one. Channels live outside of any VM
+// heap and are reference counted, every VM that holds an endpoint
+// wraps it in an ObjChannel.
+typedef struct Channel Channel;
+
+typedef enum
+{
+    MSG_NIL,
+    MSG_BOOL,
+    MSG_NUMBER,
+    MSG_STRING,
+    MSG_CHANNEL,
+} MessageType;
+
+// Values cannot cross heaps, so they travel as messages. Strings
+// are the exception: interned strings are shared by every VM (see
+// intern.h), so a message carries the string itself along with a
+// reference that the receiving VM takes over.
+typedef struct
+{
+    MessageType type;
+    union
+    {
+        bool boolean;
+        double number;
+        ObjString *string;
+        struct
+        {
+            Channel *channel;
+            int side;
+        } endpoint;
+    } as;
+} Message;
+
+Channel *openChannel(int capacity);
+void retainChannel(Channel *channel);
+void releaseChannel(Channel *channel);
+void closeChannel(Channel *channel);
+bool channelSend(Channel *channel, int side, Message message);
+bool channelReceive(Channel *channel, int side, Message *message);
+void freeMessage(Message *message);
+
+#endif
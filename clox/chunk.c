@@ -10,6 +10,7 @@ void initChunk(Chunk *chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->maxStack = 0;
 }
 
 void freeChunk(Chunk *chunk)
@@ -40,4 +41,26 @@ int addConstant(Chunk *chunk, Value value)
 {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int instructionLength(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CONCAT:
+    case OP_CALL:
+        return 2;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+        return 3;
+    default:
+        return 1;
+    }
+}
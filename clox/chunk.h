@@ -22,6 +22,7 @@ typedef enum
     OP_GREATER,
     OP_LESS,
     OP_ADD,
+    OP_CONCAT,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -31,9 +32,16 @@ typedef enum
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    OP_CALL,
     OP_RETURN
 } OpCode;
 
+// Keep OP_RETURN last
+#define OP_COUNT (OP_RETURN + 1)
+
+// The most stack slots a chunk may need, see measureStack()
+#define STACK_MAX (1024 * 1024)
+
 typedef struct
 {
     int count;
@@ -41,11 +49,14 @@ typedef struct
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int maxStack; // Deepest the stack gets, filled in by the compiler
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+// Bytes the instruction takes with its operands
+int instructionLength(uint8_t opcode);
 
 #endif
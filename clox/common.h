@@ -5,8 +5,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
-// Define debug flags
-#define DEBUG_PRINT_CODE
-// #define DEBUG_TRACE_EXECUTION
+// Interpreter state is passed around explicitly, see vm.h
+typedef struct VM VM;
+
+// Count and time opcodes, see profile.h
+// #define PROFILE_OPCODES
 
 #endif
@@ -4,22 +4,13 @@
 
 #include "common.h"
 #include "compiler.h"
-#include "scanner.h"
-
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
+#include "memory.h"
+#include "scanner.h"
+#include "trace.h"
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-typedef struct
-{
-    Token previous;
-    Token current;
-    bool hadError;  // Indicating a compile error
-    bool panicMode; // Used for error recovery
-} Parser;
-
 typedef struct
 {
     Token name; // Name of the local variable
@@ -33,6 +24,23 @@ typedef struct
     int scopeDepth;            // Total depths of locals
 } Compiler;
 
+// Everything a single compilation needs. It lives on the stack
+// of compile() and is threaded through every parsing function,
+// so compiling is reentrant and thread-safe.
+typedef struct
+{
+    Token previous;
+    Token current;
+    bool hadError;  // Indicating a compile error
+    bool panicMode; // Used for error recovery
+
+    Scanner scanner;
+    Compiler *compiler;    // Innermost compiler
+    Chunk *compilingChunk; // Chunk receiving the bytecode
+    VM *vm;                // Owner of the strings we create
+    int leftStart;         // Offset of the left operand of an infix rule
+} Parser;
+
 typedef enum
 {
     PREC_NONE,
@@ -49,7 +57,7 @@ typedef enum
 } Precedence;
 
 // A function pointer with no arguments and output void
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct
 {
@@ -58,29 +66,25 @@ typedef struct
     Precedence precedence; // Infix precedence
 } ParseRule;
 
-Parser parser;
-Compiler *current = NULL;
-Chunk *compilingChunk;
-
-static void initCompiler(Compiler *compiler)
+static void initCompiler(Parser *parser, Compiler *compiler)
 {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    parser->compiler = compiler;
 }
 
-static Chunk *currentChunk()
+static Chunk *currentChunk(Parser *parser)
 {
-    return compilingChunk;
+    return parser->compilingChunk;
 }
 
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
     // When the parser is in panic mode, we ignore the errors.
     // Panic is recovered in statement judgement.
-    if (parser.panicMode)
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
+    parser->panicMode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -90,135 +94,253 @@ static void errorAt(Token *token, const char *message)
         fprintf(stderr, " at '%.*s'", token->length, token->start);
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance()
+static void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;)
     {
-        parser.current = scanToken();
+        parser->current = scanToken(&parser->scanner);
 
-        if (parser.current.type != TOKEN_ERROR)
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (check(type))
+    if (check(parser, type))
     {
-        advance();
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser *parser, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(currentChunk(parser), value);
     if (constant > UINT8_MAX)
     {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-static void emitConstant(Value value)
+static void emitConstant(Parser *parser, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser *parser, uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitLoop(uint8_t loopStart)
+static void emitLoop(Parser *parser, int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitByte(parser, OP_LOOP);
 
     // Add the 16-bit offset
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large");
+        error(parser, "Loop body too large");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn()
+static void emitReturn(Parser *parser)
 {
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
+}
+
+// How many slots an instruction leaves on the stack, relative to
+// how many it found there. Jumps are handled by the caller.
+static int stackEffect(const uint8_t *code)
+{
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+        return -1;
+    case OP_CALL:
+        // Callee and arguments are replaced by the result
+        return -code[1];
+    case OP_CONCAT:
+        return 1 - code[1];
+    default:
+        return 0;
+    }
+}
+
+/*
+Find the deepest the stack can get while running `chunk`, so the VM
+can size the stack once up front and push() never has to check.
+
+Every reachable instruction is visited once with the depth it starts
+at, following both ways out of a conditional jump. The compiler only
+emits structured control flow, so all paths into an instruction agree
+on its depth and the first one to get there wins.
+*/
+static int measureStack(Chunk *chunk)
+{
+    int *depths = ALLOCATE(int, chunk->count);
+    int *pending = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        depths[i] = -1;
+
+    int pendingCount = 0;
+    int maxDepth = 0;
+    depths[0] = 0;
+    pending[pendingCount++] = 0;
+
+#define VISIT(target, depth)                \
+    do                                      \
+    {                                       \
+        if (depths[target] < 0)             \
+        {                                   \
+            depths[target] = depth;         \
+            pending[pendingCount++] = target; \
+        }                                   \
+    } while (false)
+
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        uint8_t *code = &chunk->code[offset];
+        int depth = depths[offset] + stackEffect(code);
+        if (depth > maxDepth)
+            maxDepth = depth;
+
+        int next = offset + instructionLength(code[0]);
+        uint16_t jump = code[0] == OP_JUMP_IF_FALSE || code[0] == OP_JUMP || code[0] == OP_LOOP
+                            ? (uint16_t)((code[1] << 8) | code[2])
+                            : 0;
+
+        switch (code[0])
+        {
+        case OP_RETURN:
+            break;
+        case OP_JUMP:
+            VISIT(next + jump, depth);
+            break;
+        case OP_LOOP:
+            VISIT(next - jump, depth);
+            break;
+        case OP_JUMP_IF_FALSE:
+            VISIT(next + jump, depth);
+            VISIT(next, depth);
+            break;
+        default:
+            VISIT(next, depth);
+            break;
+        }
+    }
+
+#undef VISIT
+
+    FREE_ARRAY(int, pending, chunk->count);
+    FREE_ARRAY(int, depths, chunk->count);
+    return maxDepth;
 }
 
-static void endCompiler()
+static void endCompiler(Parser *parser)
 {
-    emitReturn();
+    emitReturn(parser);
+
+    // Jumps may be left dangling after an error
+    if (parser->hadError)
+        return;
+
+    Chunk *chunk = currentChunk(parser);
+    traceBegin("measureStack");
+    chunk->maxStack = measureStack(chunk);
+    traceEnd("measureStack");
+    if (chunk->maxStack > STACK_MAX)
+        error(parser, "Too many values on the stack.");
 }
 
-static void expression();
-static void statement();
-static void declaration();
-static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
+static const ParseRule *getRule(TokenType type);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-static void expression()
+static void expression(Parser *parser)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void beginScope()
+static void beginScope(Parser *parser)
 {
+    Compiler *current = parser->compiler;
     current->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser *parser)
 {
+    Compiler *current = parser->compiler;
     current->scopeDepth--;
 
     // After we end a scope, we need to clear this scope's
@@ -226,22 +348,22 @@ static void endScope()
     // vars sit on the vm's stack, we need to pop them out.
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
     {
-        emitByte(OP_POP);
+        emitByte(parser, OP_POP);
         current->localCount--;
     }
 }
 
-static void block()
+static void block(Parser *parser)
 {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-        declaration();
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+        declaration(parser);
 
-    consume(TOKEN_RIGHT_BRACE, "Missing '}' after block statement.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Missing '}' after block statement.");
 }
 
-static uint8_t identifierConstant(Token *name)
+static uint8_t identifierConstant(Parser *parser, Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
 }
 
 static bool identifierEqual(Token *a, Token *b)
@@ -251,15 +373,16 @@ static bool identifierEqual(Token *a, Token *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser *parser, Token name)
 {
+    Compiler *current = parser->compiler;
     // Add a local var to the locals field in the compiler
     Local *local = &current->locals[current->localCount++];
 
     // Check whether the number of local vars exceeds the limit
     if (current->localCount >= UINT8_COUNT)
     {
-        error("Too many local variables in function.");
+        error(parser, "Too many local variables in function.");
         return;
     }
 
@@ -268,14 +391,15 @@ static void addLocal(Token name)
     // Mark uninitialized
 }
 
-static void declareVariable()
+static void declareVariable(Parser *parser)
 {
+    Compiler *current = parser->compiler;
     // Declaring a variable is when it's added to a scope
 
     if (current->scopeDepth == 0)
         return;
 
-    Token *name = &parser.previous;
+    Token *name = &parser->previous;
     // Check whether a local with the same name as
     // `name->start` exists
 
@@ -293,47 +417,50 @@ static void declareVariable()
             break;
 
         if (identifierEqual(name, &local->name))
-            error("Already a variable with this name exists in the scope");
+            error(parser, "Already a variable with this name exists in the scope");
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char *message)
+static uint8_t parseVariable(Parser *parser, const char *message)
 {
+    Compiler *current = parser->compiler;
     // The idea is that we store the variable name as
     // a string constant so that we can look it up with
     // our hash table.
-    consume(TOKEN_IDENTIFIER, message);
+    consume(parser, TOKEN_IDENTIFIER, message);
 
     // Local variable, return fake index 0
-    declareVariable();
+    declareVariable(parser);
     if (current->scopeDepth > 0)
         return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser *parser)
 {
+    Compiler *current = parser->compiler;
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser *parser, uint8_t global)
 {
+    Compiler *current = parser->compiler;
     // Defining a variable is when it's available to use
 
     // If we're seeing a local variable, skip the definition
     if (current->scopeDepth > 0)
     {
-        markInitialized();
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
 // Search in `compiler`'s local var field
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--)
     {
@@ -341,18 +468,18 @@ static int resolveLocal(Compiler *compiler, Token *name)
         if (identifierEqual(name, &local->name))
         {
             if (local->depth == -1)
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             return i;
         }
     }
     return -1;
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
 
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
@@ -361,170 +488,170 @@ static void namedVariable(Token name, bool canAssign)
     }
     else
     {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
     // Add one look ahead for possible assignment
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
     }
     else
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(parser, getOp, (uint8_t)arg);
 }
 
-static void variable(bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void varDeclaration()
+static void varDeclaration(Parser *parser)
 {
     // A lot like reading constants except for different op code.
-    uint8_t global = parseVariable("Expect identifier after 'var'.");
+    uint8_t global = parseVariable(parser, "Expect identifier after 'var'.");
 
-    if (match(TOKEN_EQUAL))
-        expression();
+    if (match(parser, TOKEN_EQUAL))
+        expression(parser);
     else
-        emitByte(OP_NIL);
-    consume(TOKEN_SEMICOLON, "Expect ';' after var declaration");
+        emitByte(parser, OP_NIL);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after var declaration");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Missing ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Missing ';' after expression.");
+    emitByte(parser, OP_POP);
     // For now without function support,
     // we just pop the values out.
 }
 
-static void printStatement()
+static void printStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Missing ';' after print.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Missing ';' after print.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void patchJump(int offset)
+static void patchJump(Parser *parser, int offset)
 {
     // Minus 2: skipping the 16-bit offset.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX)
-        error("Too much code to jump");
+        error(parser, "Too much code to jump");
 
-    currentChunk()->code[offset] = jump >> 8 & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = jump >> 8 & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void ifStatement()
+static void ifStatement(Parser *parser)
 {
-    consume(TOKEN_LEFT_PAREN, "Missing '(' after if.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Missing ')' after if condition.");
+    consume(parser, TOKEN_LEFT_PAREN, "Missing '(' after if.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Missing ')' after if condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
 
-    statement();
-    int elseJump = emitJump(OP_JUMP);
+    statement(parser);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE))
-        statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE))
+        statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void whileStatement()
+static void whileStatement(Parser *parser)
 {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Missing '(' after while.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Missing ')' after while condition");
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Missing '(' after while.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Missing ')' after while condition");
 
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(endJump);
-    emitByte(OP_POP);
+    patchJump(parser, endJump);
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement()
+static void forStatement(Parser *parser)
 {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Missing '(' after for.");
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Missing '(' after for.");
 
     // Parsing initializers, execute only once.
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
         ; // No initializer
-    else if (match(TOKEN_VAR))
-        varDeclaration();
+    else if (match(parser, TOKEN_VAR))
+        varDeclaration(parser);
     else
-        expressionStatement();
+        expressionStatement(parser);
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
 
     // Parsing conditions, execute multiple times
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON))
+    if (!match(parser, TOKEN_SEMICOLON))
     {
         // For loop condition
         // We didn't use `expressionStatement` here
         // since we need the expression result to determine
         // whether to jump. An `expressionStatement`
         // will emit an OP_POP, jeopardizing the work flow.
-        expression();
-        consume(TOKEN_SEMICOLON, "Missing expression in for loop condition");
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Missing expression in for loop condition");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
     }
 
     // Parseing incremental expressions
-    if (!match(TOKEN_RIGHT_PAREN))
+    if (!match(parser, TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementLoop = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Missing ')' after for loop.");
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementLoop = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Missing ')' after for loop.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementLoop;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1)
     {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
     }
-    endScope();
+    endScope(parser);
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
 
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_RETURN:
         case TOKEN_CLASS:
@@ -538,81 +665,101 @@ static void synchronize()
         default:;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-    if (match(TOKEN_VAR))
-        varDeclaration();
+    if (match(parser, TOKEN_VAR))
+        varDeclaration(parser);
     else
-        statement();
+        statement(parser);
 
-    if (parser.hadError)
-        synchronize();
+    if (parser->hadError)
+        synchronize(parser);
 }
 
-static void statement()
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT))
-        printStatement();
-    else if (match(TOKEN_LEFT_BRACE))
+    if (match(parser, TOKEN_PRINT))
+        printStatement(parser);
+    else if (match(parser, TOKEN_LEFT_BRACE))
     {
-        beginScope();
-        block();
-        endScope();
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
-    else if (match(TOKEN_IF))
-        ifStatement();
-    else if (match(TOKEN_WHILE))
-        whileStatement();
-    else if (match(TOKEN_FOR))
-        forStatement();
+    else if (match(parser, TOKEN_IF))
+        ifStatement(parser);
+    else if (match(parser, TOKEN_WHILE))
+        whileStatement(parser);
+    else if (match(parser, TOKEN_FOR))
+        forStatement(parser);
     else
-        expressionStatement();
+        expressionStatement(parser);
 }
 
 // Infix expression
-static void and_(bool canAssign)
+static void and_(Parser *parser, bool canAssign)
 {
     // As we parse `and` keyword, the left operand
     // has already being parsed and evaluated (during
     // execution). Same for `or`.
 
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
 // Infix expression
-static void or_(bool canAssign)
+static void or_(Parser *parser, bool canAssign)
 {
     // We could implement an OP_JUMP_IF_TRUE op code
     // which reduces the jump overheads
     // But for demonstration purpose, jump false & jump
     // could implement a jump true.
 
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
+
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
+}
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+// Whether the code from `start` to `end` is nothing but a string
+// constant
+static bool isStringLiteral(Parser *parser, int start, int end)
+{
+    Chunk *chunk = currentChunk(parser);
+    return end - start == 2 && chunk->code[start] == OP_CONSTANT &&
+           IS_TEXT(chunk->constants.values[chunk->code[start + 1]]);
+}
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+// Add up the last `count` values on the stack
+static void emitAdds(Parser *parser, int count)
+{
+    if (count == 2)
+        emitByte(parser, OP_ADD);
+    else if (count > 2)
+        emitBytes(parser, OP_CONCAT, (uint8_t)count);
 }
 
 // Infix expression
 // This function takes place after prefix expression.
-static void binary(bool canAssign)
+static void binary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
-    ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence)rule->precedence + 1);
+    TokenType operatorType = parser->previous.type;
+    const ParseRule *rule = getRule(operatorType);
+    int leftStart = parser->leftStart;
+    int rightStart = currentChunk(parser)->count;
+    parsePrecedence(parser, (Precedence)rule->precedence + 1);
     // The reason why we add 1 is that binary operations
     // are left-associative meaning 1 + 2 + 3 is actually
     // ((1 + 2) + 3). Thus, we only want 2 instead of the
@@ -621,53 +768,104 @@ static void binary(bool canAssign)
     switch (operatorType)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+    {
+        // Fold the rest of a chain like "a" + "b" + c in as well, so
+        // strings can be joined in one go. Adding known strings can't
+        // fail, so those adds may wait until the next operand has run.
+        // Any other sum is added before the next operand runs, or its
+        // side effects would happen ahead of the error.
+        int end = currentChunk(parser)->count;
+        bool strings = isStringLiteral(parser, leftStart, rightStart) && isStringLiteral(parser, rightStart, end);
+        int count = 2;
+        while (check(parser, TOKEN_PLUS))
+        {
+            if (!strings || count == UINT8_MAX)
+            {
+                emitAdds(parser, count);
+                count = 1;
+            }
+
+            advance(parser);
+            int start = currentChunk(parser)->count;
+            parsePrecedence(parser, (Precedence)rule->precedence + 1);
+            strings = strings && isStringLiteral(parser, start, currentChunk(parser)->count);
+            count++;
+        }
+
+        emitAdds(parser, count);
         break;
+    }
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitByte(parser, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitByte(parser, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitByte(parser, OP_DIVIDE);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitByte(parser, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitByte(parser, OP_GREATER);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitByte(parser, OP_LESS);
         break;
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitBytes(parser, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitBytes(parser, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitBytes(parser, OP_GREATER, OP_NOT);
         break;
     default:
         return;
     }
 }
 
+static uint8_t argumentList(Parser *parser)
+{
+    uint8_t argCount = 0;
+    if (!check(parser, TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            expression(parser);
+            if (argCount == 255)
+                error(parser, "Can't have more than 255 arguments.");
+            argCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+// Infix expression
+// The callee is already on the stack, the arguments go on top of it.
+static void call(Parser *parser, bool canAssign)
+{
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+}
+
 // Prefix expression
-static void literal(bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitByte(parser, OP_TRUE);
         break;
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitByte(parser, OP_FALSE);
         break;
     default:
         return;
@@ -675,39 +873,39 @@ static void literal(bool canAssign)
 }
 
 // Prefix expression
-static void number(bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // The scanner has worked out the value already
+    emitConstant(parser, NUMBER_VAL(parser->previous.number));
 }
 
 // Prefix expression
-static void string(bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(parser, stringValue(parser->vm, parser->previous.start + 1, parser->previous.length - 2));
 }
 
 // Prefix expression
-static void grouping(bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 // Prefix expression
-static void unary(bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     switch (operatorType)
     {
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitByte(parser, OP_NEGATE);
         break;
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitByte(parser, OP_NOT);
         break;
     default:
         return;
@@ -716,8 +914,8 @@ static void unary(bool canAssign)
 
 // Map each token to a specific rule for prefix & infix parsing.
 // These sets of rules are made specifically for expression.
-ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+static const ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
@@ -760,60 +958,63 @@ ParseRule rules[] = {
 };
 
 // Parse precedence >= `precedence`
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixFn = getRule(parser.previous.type)->prefix;
+    int start = currentChunk(parser)->count;
+    advance(parser);
+    ParseFn prefixFn = getRule(parser->previous.type)->prefix;
     if (prefixFn == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixFn(canAssign);
+    prefixFn(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixFn = getRule(parser.previous.type)->infix;
-        infixFn(canAssign);
+        advance(parser);
+        ParseFn infixFn = getRule(parser->previous.type)->infix;
+        parser->leftStart = start;
+        infixFn(parser, canAssign);
     }
 
     // The idea here is if we cannot even parse '=' in the
     // while loop, then no where in the code are we able to
     // parse it. Thus, it's definitely an invalid assignment.
-    if (canAssign && match(TOKEN_EQUAL))
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL))
+        error(parser, "Invalid assignment target.");
 }
 
-static ParseRule *getRule(TokenType type)
+static const ParseRule *getRule(TokenType type)
 {
     return &rules[type];
 }
 
-bool compile(const char *source, Chunk *chunk)
+bool compile(VM *vm, const char *source, Chunk *chunk)
 {
-    initScanner(source);
+    Parser state;
+    Parser *parser = &state;
+    initScanner(&parser->scanner, source);
 
     Compiler compiler;
-    initCompiler(&compiler);
-    compilingChunk = chunk;
+    initCompiler(parser, &compiler);
+    parser->compilingChunk = chunk;
+    parser->vm = vm;
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    parser->hadError = false;
+    parser->panicMode = false;
 
-    advance();
+    advance(parser);
 
-    while (!match(TOKEN_EOF))
-        declaration();
+    while (!match(parser, TOKEN_EOF))
+        declaration(parser);
 
-    endCompiler();
+    endCompiler(parser);
 
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
-        disassembleChunk(currentChunk(), "code");
+    if (vm->disassemble && !parser->hadError)
+        disassembleChunk(currentChunk(parser), "code");
 
-#endif
-    return !parser.hadError;
+    return !parser->hadError;
 }
\ No newline at end of file
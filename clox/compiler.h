@@ -4,6 +4,6 @@
 #include "vm.h"
 #include "object.h"
 
-bool compile(const char *source, Chunk *chunk);
+bool compile(VM *vm, const char *source, Chunk *chunk);
 
 #endif
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "counters.h"
+
+bool counting = false;
+
+typedef struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} CounterInfo;
+
+#define L1D_READ(result)                                                 \
+    (PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     ((uint64_t)(result) << 16))
+
+static const CounterInfo infos[COUNTER_COUNT] = {
+    [COUNTER_TASK_CLOCK] = {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    [COUNTER_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_BRANCHES] = {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    [COUNTER_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [COUNTER_L1D_READS] = {"L1d-reads", PERF_TYPE_HW_CACHE, L1D_READ(PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    [COUNTER_L1D_MISSES] = {"L1d-misses", PERF_TYPE_HW_CACHE, L1D_READ(PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+
+static const char *phaseNames[PHASE_COUNT] = {
+    [PHASE_COMPILE] = "compile",
+    [PHASE_RUN] = "run",
+};
+
+static int fds[COUNTER_COUNT];
+static struct perf_event_mmap_page *pages[COUNTER_COUNT];
+static int openErrors[COUNTER_COUNT];
+static pthread_t countedThread;
+
+static uint64_t phaseStart[PHASE_COUNT][COUNTER_COUNT];
+static uint64_t phaseTotals[PHASE_COUNT][COUNTER_COUNT];
+static int phaseCalls[PHASE_COUNT];
+
+static int openCounter(const CounterInfo *info)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = info->type;
+    attr.config = info->config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+bool openCounters()
+{
+    bool any = false;
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        fds[i] = openCounter(&infos[i]);
+        pages[i] = NULL;
+        openErrors[i] = fds[i] < 0 ? errno : 0;
+        if (fds[i] < 0)
+            continue;
+        any = true;
+
+        // The first page tells whether rdpmc may be used, and how
+        void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fds[i], 0);
+        if (page != MAP_FAILED)
+            pages[i] = page;
+    }
+
+    countedThread = pthread_self();
+    counting = any;
+    return any;
+}
+
+void closeCounters()
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (pages[i] != NULL)
+            munmap(pages[i], sysconf(_SC_PAGESIZE));
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+        pages[i] = NULL;
+    }
+    counting = false;
+}
+
+static void readCounters(uint64_t values[COUNTER_COUNT])
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        uint64_t data[3]; // Value, time enabled, time running
+        values[i] = 0;
+        if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            continue;
+        values[i] = data[1] == data[2] ? data[0] : (uint64_t)((double)data[0] * data[1] / data[2]);
+    }
+}
+
+// Only the thread the counters belong to measures anything, other
+// VMs go about their business
+static bool countsHere()
+{
+    return counting && pthread_equal(pthread_self(), countedThread);
+}
+
+void beginPhase(Phase phase)
+{
+    if (countsHere())
+        readCounters(phaseStart[phase]);
+}
+
+void endPhase(Phase phase)
+{
+    if (!countsHere())
+        return;
+
+    uint64_t now[COUNTER_COUNT];
+    readCounters(now);
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        phaseTotals[phase][i] += now[i] - phaseStart[phase][i];
+    phaseCalls[phase]++;
+}
+
+static double ratio(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0 : (double)part / total;
+}
+
+static void printCell(FILE *out, bool open, const char *format, double value)
+{
+    if (open)
+        fprintf(out, format, value);
+    else
+        fprintf(out, " %12s", "-");
+}
+
+void printCounters(FILE *out)
+{
+    bool open[COUNTER_COUNT];
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        open[i] = fds[i] >= 0;
+        if (!open[i])
+            fprintf(out, "[counters] %s unavailable: %s\n", infos[i].name, strerror(openErrors[i]));
+    }
+
+    fprintf(out, "%-8s %6s %12s %12s %12s %12s %12s %12s %12s\n", "phase", "calls", "cpu ms", "cycles",
+            "instructions", "IPC", "branch miss%", "misses/kinst", "L1d miss%");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        uint64_t *totals = phaseTotals[p];
+        fprintf(out, "%-8s %6d", phaseNames[p], phaseCalls[p]);
+        printCell(out, open[COUNTER_TASK_CLOCK], " %12.3f", totals[COUNTER_TASK_CLOCK] / 1e6);
+        printCell(out, open[COUNTER_CYCLES], " %12.0f", (double)totals[COUNTER_CYCLES]);
+        printCell(out, open[COUNTER_INSTRUCTIONS], " %12.0f", (double)totals[COUNTER_INSTRUCTIONS]);
+        printCell(out, open[COUNTER_CYCLES] && open[COUNTER_INSTRUCTIONS], " %12.2f",
+                  ratio(totals[COUNTER_INSTRUCTIONS], totals[COUNTER_CYCLES]));
+        printCell(out, open[COUNTER_BRANCHES] && open[COUNTER_BRANCH_MISSES], " %12.2f",
+                  100 * ratio(totals[COUNTER_BRANCH_MISSES], totals[COUNTER_BRANCHES]));
+        printCell(out, open[COUNTER_INSTRUCTIONS] && open[COUNTER_BRANCH_MISSES], " %12.2f",
+                  1000 * ratio(totals[COUNTER_BRANCH_MISSES], totals[COUNTER_INSTRUCTIONS]));
+        printCell(out, open[COUNTER_L1D_READS] && open[COUNTER_L1D_MISSES], " %12.2f",
+                  100 * ratio(totals[COUNTER_L1D_MISSES], totals[COUNTER_L1D_READS]));
+        fprintf(out, "\n");
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (uint64_t)high << 32 | low;
+}
+
+// The read loop from the perf_event_mmap_page documentation
+static bool readMapped(struct perf_event_mmap_page *page, uint64_t *value)
+{
+    uint32_t seq;
+    uint64_t count;
+    do
+    {
+        seq = page->lock;
+        __sync_synchronize();
+
+        uint32_t index = page->index;
+        if (!page->cap_user_rdpmc || index == 0)
+            return false;
+
+        // Sign extend the counter's width
+        int shift = 64 - page->pmc_width;
+        int64_t pmc = (int64_t)(rdpmc(index - 1) << shift) >> shift;
+        count = page->offset + pmc;
+
+        __sync_synchronize();
+    } while (page->lock != seq);
+
+    *value = count;
+    return true;
+}
+#else
+static bool readMapped(struct perf_event_mmap_page *page, uint64_t *value)
+{
+    (void)page;
+    (void)value;
+    return false;
+}
+#endif
+
+bool readCountersFast(uint64_t values[COUNTER_COUNT])
+{
+    bool any = false;
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        // The software ones only count in the kernel
+        values[i] = 0;
+        if (fds[i] < 0 || infos[i].type == PERF_TYPE_SOFTWARE)
+            continue;
+        if (pages[i] == NULL || !readMapped(pages[i], &values[i]))
+            return false;
+        any = true;
+    }
+    return any;
+}
+
+bool hasFastCounters()
+{
+    uint64_t values[COUNTER_COUNT];
+    return countsHere() && readCountersFast(values);
+}
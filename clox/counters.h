@@ -0,0 +1,59 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+Hardware performance counters, read through perf_event_open(2), to
+tell whether a change to run() actually cuts mispredictions and
+cache misses rather than just moving time around.
+
+The counters are opened for the thread that asks for them and
+accumulated per phase: compiling a script, and running it. Counts
+are scaled by the time each counter was scheduled, in case the
+kernel had to multiplex them. Counters the machine, kernel or
+perf_event_paranoid setting won't give us are left out of the report;
+inside most virtual machines that is all the hardware ones.
+
+The opcode profiler (profile.h) also attributes the counters to
+single instructions when the CPU lets user space read them with
+rdpmc, which costs tens of cycles instead of a system call.
+*/
+
+typedef enum
+{
+    COUNTER_TASK_CLOCK, // Nanoseconds on the CPU, a software counter
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCHES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_READS,
+    COUNTER_L1D_MISSES,
+    COUNTER_COUNT
+} Counter;
+
+typedef enum
+{
+    PHASE_COMPILE,
+    PHASE_RUN,
+    PHASE_COUNT
+} Phase;
+
+extern bool counting;
+
+// Open the counters for the calling thread, false if none could be
+// opened at all
+bool openCounters();
+void closeCounters();
+void beginPhase(Phase phase);
+void endPhase(Phase phase);
+void printCounters(FILE *out);
+
+// Read the hardware counters from user space, false when rdpmc isn't
+// allowed for every one of them. Zero for those that aren't open.
+bool readCountersFast(uint64_t values[COUNTER_COUNT]);
+bool hasFastCounters();
+
+#endif
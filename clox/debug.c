@@ -32,6 +32,40 @@ static int jumpInstruction(const char *name, Chunk *chunk, int sign, int offset)
     return offset + 3;
 }
 
+static const char *opcodeNames[OP_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_CONCAT] = "OP_CONCAT",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+    return opcode < OP_COUNT ? opcodeNames[opcode] : NULL;
+}
+
 void disassembleChunk(Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
@@ -44,7 +78,7 @@ int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 & chunk->lines[offset] == chunk->lines[offset - 1])
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
         printf("   | ");
     else
         printf("%4d ", chunk->lines[offset]);
@@ -80,6 +114,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return simpleInstruction("OP_LESS", offset);
     case OP_ADD:
         return simpleInstruction("OP_ADD", offset);
+    case OP_CONCAT:
+        return byteInstruction("OP_CONCAT", chunk, offset);
     case OP_SUBTRACT:
         return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
@@ -98,6 +134,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return jumpInstruction("OP_JUMP", chunk, 1, offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", chunk, -1, offset);
+    case OP_CALL:
+        return byteInstruction("OP_CALL", chunk, offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
     default:
@@ -5,5 +5,7 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+// "OP_ADD" and so on, NULL for a byte that is no opcode
+const char *opcodeName(uint8_t opcode);
 
 #endif
@@ -0,0 +1,496 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "fiber.h"
+#include "memory.h"
+#include "vm.h"
+
+#define MAX_EVENTS 64
+
+static void initEventLoop(EventLoop *loop)
+{
+    loop->epollFd = -1;
+    loop->readyHead = NULL;
+    loop->readyTail = NULL;
+    loop->live = NULL;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->fdWaiters = 0;
+    loop->fds = NULL;
+    loop->fdCapacity = 0;
+}
+
+static void freeEventLoop(EventLoop *loop)
+{
+    if (loop->epollFd >= 0)
+        close(loop->epollFd);
+    // The script may never have closed the pipes it asked for
+    for (int fd = 0; fd < loop->fdCapacity; fd++)
+    {
+        if (loop->fds[fd].pipe)
+            close(fd);
+    }
+    FREE_ARRAY(Fiber *, loop->timers, loop->timerCapacity);
+    FREE_ARRAY(FdState, loop->fds, loop->fdCapacity);
+    initEventLoop(loop);
+}
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void saveRegisters(VM *vm, Fiber *fiber)
+{
+    fiber->chunk = vm->chunk;
+    fiber->ip = vm->ip;
+    fiber->stackTop = vm->stackTop;
+}
+
+static void loadRegisters(VM *vm, Fiber *fiber)
+{
+    vm->fiber = fiber;
+    vm->chunk = fiber->chunk;
+    vm->ip = fiber->ip;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    fiber->state = FIBER_RUNNING;
+}
+
+// Make room for `needed` slots, moving whatever is already there
+static void growStack(Fiber *fiber, int needed)
+{
+    if (fiber->stackCapacity >= needed)
+        return;
+
+    int oldCapacity = fiber->stackCapacity;
+    int capacity = oldCapacity;
+    while (capacity < needed)
+        capacity = GROW_CAPACITY(capacity);
+
+    int depth = (int)(fiber->stackTop - fiber->stack);
+    fiber->stack = GROW_ARRAY(Value, fiber->stack, oldCapacity, capacity);
+    fiber->stackTop = fiber->stack + depth;
+    fiber->stackCapacity = capacity;
+}
+
+static void freeFiber(Fiber *fiber)
+{
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    freeChunk(&fiber->code);
+    FREE(Fiber, fiber);
+}
+
+static void initFiber(Fiber *fiber, Chunk *chunk)
+{
+    fiber->state = FIBER_READY;
+    fiber->resumed = false;
+    fiber->chunk = chunk;
+    fiber->ip = chunk->code;
+    fiber->stackTop = fiber->stack;
+    growStack(fiber, chunk->maxStack);
+    fiber->wakeAt = 0;
+    fiber->fd = -1;
+    fiber->next = NULL;
+    fiber->prevLive = NULL;
+    fiber->nextLive = NULL;
+}
+
+static void pushReady(EventLoop *loop, Fiber *fiber)
+{
+    fiber->state = FIBER_READY;
+    fiber->next = NULL;
+    if (loop->readyTail == NULL)
+        loop->readyHead = fiber;
+    else
+        loop->readyTail->next = fiber;
+    loop->readyTail = fiber;
+}
+
+static Fiber *popReady(EventLoop *loop)
+{
+    Fiber *fiber = loop->readyHead;
+    if (fiber == NULL)
+        return NULL;
+
+    loop->readyHead = fiber->next;
+    if (loop->readyHead == NULL)
+        loop->readyTail = NULL;
+    return fiber;
+}
+
+static void wake(EventLoop *loop, Fiber *fiber)
+{
+    fiber->resumed = true;
+    pushReady(loop, fiber);
+}
+
+// The timer heap is ordered by `wakeAt`, earliest first
+static void pushTimer(EventLoop *loop, Fiber *fiber)
+{
+    if (loop->timerCount == loop->timerCapacity)
+    {
+        int oldCapacity = loop->timerCapacity;
+        loop->timerCapacity = GROW_CAPACITY(oldCapacity);
+        loop->timers = GROW_ARRAY(Fiber *, loop->timers, oldCapacity, loop->timerCapacity);
+    }
+
+    int i = loop->timerCount++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (loop->timers[parent]->wakeAt <= fiber->wakeAt)
+            break;
+        loop->timers[i] = loop->timers[parent];
+        i = parent;
+    }
+    loop->timers[i] = fiber;
+}
+
+static Fiber *popTimer(EventLoop *loop)
+{
+    Fiber *top = loop->timers[0];
+    Fiber *last = loop->timers[--loop->timerCount];
+
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= loop->timerCount)
+            break;
+        if (child + 1 < loop->timerCount && loop->timers[child + 1]->wakeAt < loop->timers[child]->wakeAt)
+            child++;
+        if (last->wakeAt <= loop->timers[child]->wakeAt)
+            break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    if (loop->timerCount > 0)
+        loop->timers[i] = last;
+    return top;
+}
+
+static FdState *fdState(EventLoop *loop, int fd)
+{
+    if (fd >= loop->fdCapacity)
+    {
+        int oldCapacity = loop->fdCapacity;
+        int capacity = oldCapacity;
+        while (fd >= capacity)
+            capacity = GROW_CAPACITY(capacity);
+
+        loop->fds = GROW_ARRAY(FdState, loop->fds, oldCapacity, capacity);
+        for (int i = oldCapacity; i < capacity; i++)
+        {
+            loop->fds[i].readers = NULL;
+            loop->fds[i].writers = NULL;
+            loop->fds[i].events = 0;
+            loop->fds[i].pipeWriter = -1;
+            loop->fds[i].pipe = false;
+        }
+        loop->fdCapacity = capacity;
+    }
+    return &loop->fds[fd];
+}
+
+static void wakeAll(EventLoop *loop, Fiber **waiters)
+{
+    Fiber *fiber = *waiters;
+    *waiters = NULL;
+    while (fiber != NULL)
+    {
+        Fiber *next = fiber->next;
+        fiber->fd = -1;
+        loop->fdWaiters--;
+        wake(loop, fiber);
+        fiber = next;
+    }
+}
+
+// Bring the epoll registration of `fd` in line with its waiters
+static int updateInterest(EventLoop *loop, int fd)
+{
+    FdState *state = &loop->fds[fd];
+    uint32_t events = (state->readers != NULL ? EPOLLIN : 0) | (state->writers != NULL ? EPOLLOUT : 0);
+    if (events == state->events)
+        return 0;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+
+    int result;
+    if (events == 0)
+        result = epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    else if (state->events == 0)
+        result = epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event);
+    else
+        result = epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, fd, &event);
+
+    if (result == 0)
+        state->events = events;
+    return result;
+}
+
+// Block until at least one parked fiber can be woken up
+static void pollEvents(EventLoop *loop)
+{
+    int timeout = -1;
+    if (loop->timerCount > 0)
+    {
+        int64_t wait = loop->timers[0]->wakeAt - nowNs();
+        timeout = wait <= 0 ? 0 : (int)((wait + 999999) / 1000000);
+    }
+
+    if (loop->fdWaiters > 0)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            FdState *state = &loop->fds[fd];
+            uint32_t ready = events[i].events;
+
+            // Wake everyone, whoever loses the race parks again
+            if (ready & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                wakeAll(loop, &state->readers);
+            if (ready & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                wakeAll(loop, &state->writers);
+            updateInterest(loop, fd);
+        }
+    }
+    else if (timeout > 0)
+    {
+        struct timespec ts = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+
+    int64_t now = nowNs();
+    while (loop->timerCount > 0 && loop->timers[0]->wakeAt <= now)
+        wake(loop, popTimer(loop));
+}
+
+bool switchFiber(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    Fiber *current = vm->fiber;
+    if (current->state != FIBER_DONE)
+        saveRegisters(vm, current);
+
+    for (;;)
+    {
+        Fiber *next = popReady(loop);
+        if (next != NULL)
+        {
+            loadRegisters(vm, next);
+            return true;
+        }
+
+        if (loop->fdWaiters == 0 && loop->timerCount == 0)
+            return false;
+        pollEvents(loop);
+    }
+}
+
+// The running fiber reached its OP_RETURN
+bool finishFiber(VM *vm)
+{
+    Fiber *done = vm->fiber;
+    done->state = FIBER_DONE;
+    bool more = switchFiber(vm);
+
+    if (done != &vm->root)
+    {
+        EventLoop *loop = &vm->loop;
+        if (done->prevLive != NULL)
+            done->prevLive->nextLive = done->nextLive;
+        else
+            loop->live = done->nextLive;
+        if (done->nextLive != NULL)
+            done->nextLive->prevLive = done->prevLive;
+
+        freeFiber(done);
+    }
+    return more;
+}
+
+void initFibers(VM *vm)
+{
+    initEventLoop(&vm->loop);
+    vm->root.stack = NULL;
+    vm->root.stackTop = NULL;
+    vm->root.stackCapacity = 0;
+    startRootFiber(vm, &vm->script);
+}
+
+void freeFibers(VM *vm)
+{
+    resetFibers(vm);
+    FREE_ARRAY(Value, vm->root.stack, vm->root.stackCapacity);
+    freeEventLoop(&vm->loop);
+}
+
+void startRootFiber(VM *vm, Chunk *chunk)
+{
+    initFiber(&vm->root, chunk);
+    loadRegisters(vm, &vm->root);
+}
+
+bool spawnFiber(VM *vm, const char *source, int length)
+{
+    // The compiler wants a terminated string
+    char *terminated = ALLOCATE(char, length + 1);
+    memcpy(terminated, source, length);
+    terminated[length] = '\0';
+
+    Fiber *fiber = ALLOCATE(Fiber, 1);
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+    initChunk(&fiber->code);
+    bool compiled = compile(vm, terminated, &fiber->code);
+    FREE_ARRAY(char, terminated, length + 1);
+
+    if (!compiled)
+    {
+        freeFiber(fiber);
+        return false;
+    }
+
+    EventLoop *loop = &vm->loop;
+    initFiber(fiber, &fiber->code);
+    fiber->nextLive = loop->live;
+    if (loop->live != NULL)
+        loop->live->prevLive = fiber;
+    loop->live = fiber;
+
+    pushReady(loop, fiber);
+    return true;
+}
+
+// Drop every spawned fiber, used when a script ends in an error
+void resetFibers(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    Fiber *fiber = loop->live;
+    while (fiber != NULL)
+    {
+        Fiber *next = fiber->nextLive;
+        freeFiber(fiber);
+        fiber = next;
+    }
+
+    vm->root.fd = -1;
+    for (int fd = 0; fd < loop->fdCapacity; fd++)
+    {
+        FdState *state = &loop->fds[fd];
+        state->readers = NULL;
+        state->writers = NULL;
+        updateInterest(loop, fd);
+    }
+
+    loop->live = NULL;
+    loop->readyHead = NULL;
+    loop->readyTail = NULL;
+    loop->timerCount = 0;
+    loop->fdWaiters = 0;
+}
+
+bool fiberResumed(VM *vm)
+{
+    bool resumed = vm->fiber->resumed;
+    vm->fiber->resumed = false;
+    return resumed;
+}
+
+void yieldFiber(VM *vm)
+{
+    wake(&vm->loop, vm->fiber);
+}
+
+void sleepFiber(VM *vm, double ms)
+{
+    Fiber *fiber = vm->fiber;
+    fiber->state = FIBER_WAITING;
+    fiber->wakeAt = nowNs() + (int64_t)(ms * 1000000);
+    pushTimer(&vm->loop, fiber);
+}
+
+/*
+Returns
+-------
+- 1: the fiber is parked until `fd` becomes readable / writable
+- 0: `fd` cannot be polled (a regular file) and is always ready
+- -1: waiting failed, errno tells why
+*/
+int waitForFd(VM *vm, int fd, bool writable)
+{
+    EventLoop *loop = &vm->loop;
+    if (loop->epollFd < 0)
+    {
+        loop->epollFd = epoll_create1(0);
+        if (loop->epollFd < 0)
+            return -1;
+    }
+
+    Fiber *fiber = vm->fiber;
+    FdState *state = fdState(loop, fd);
+    Fiber **waiters = writable ? &state->writers : &state->readers;
+    fiber->next = *waiters;
+    *waiters = fiber;
+
+    if (updateInterest(loop, fd) < 0)
+    {
+        int error = errno;
+        *waiters = fiber->next;
+        errno = error;
+        return error == EPERM ? 0 : -1;
+    }
+
+    fiber->state = FIBER_WAITING;
+    fiber->fd = fd;
+    loop->fdWaiters++;
+    return 1;
+}
+
+// Both ends belong to the loop until the script closes them
+void addPipe(EventLoop *loop, int readFd, int writeFd)
+{
+    fdState(loop, readFd)->pipeWriter = writeFd;
+    fdState(loop, readFd)->pipe = true;
+    fdState(loop, writeFd)->pipe = true;
+}
+
+// Call before closing `fd`: its waiters are woken up to find out,
+// and a recycled descriptor number starts with a clean slate.
+void forgetFd(EventLoop *loop, int fd)
+{
+    if (fd < 0 || fd >= loop->fdCapacity)
+        return;
+
+    FdState *state = &loop->fds[fd];
+    wakeAll(loop, &state->readers);
+    wakeAll(loop, &state->writers);
+    updateInterest(loop, fd);
+    state->pipeWriter = -1;
+    state->pipe = false;
+}
+
+int getPipeWriter(EventLoop *loop, int readFd)
+{
+    if (readFd < 0 || readFd >= loop->fdCapacity)
+        return -1;
+    return loop->fds[readFd].pipeWriter;
+}
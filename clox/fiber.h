@@ -0,0 +1,99 @@
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+typedef enum
+{
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,
+    FIBER_DONE,
+} FiberState;
+
+/*
+A lightweight thread of Lox code inside one VM. Fibers share the
+VM's heap and globals but have a value stack and an ip of their own.
+The running fiber's registers (chunk, ip, stack, stackTop) are kept
+in the VM itself and only written back here when switching.
+
+The root fiber runs the script handed to interpret(), every other
+fiber owns the chunk it was compiled into. The stack is sized for the
+deepest its chunk can go (Chunk.maxStack) before the fiber first runs,
+so pushes never need to check for overflow.
+*/
+typedef struct Fiber
+{
+    FiberState state;
+    bool resumed; // Woken from a wait, the parked native may finish
+    Chunk *chunk;
+    uint8_t *ip;
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+
+    Chunk code;     // Owned chunk of a spawned fiber
+    int64_t wakeAt; // Monotonic deadline of a sleep
+    int fd;         // Descriptor waited on, -1 for none
+
+    struct Fiber *next;     // Ready queue or waiters of `fd`
+    struct Fiber *prevLive; // All spawned fibers
+    struct Fiber *nextLive;
+} Fiber;
+
+// Everything the loop knows about one descriptor
+typedef struct
+{
+    Fiber *readers;  // Waiting for EPOLLIN
+    Fiber *writers;  // Waiting for EPOLLOUT
+    uint32_t events; // Registered with epoll, 0 for none
+    int pipeWriter;  // Write end if this is the read end of a pipe()
+    bool pipe;       // Made by pipe(), closed along with the loop
+} FdState;
+
+typedef struct
+{
+    int epollFd; // Created on the first wait, -1 before
+    Fiber *readyHead;
+    Fiber *readyTail;
+    Fiber *live; // Spawned fibers that have not finished
+
+    Fiber **timers; // Min-heap on `wakeAt`
+    int timerCount;
+    int timerCapacity;
+    int fdWaiters;
+
+    FdState *fds; // Indexed by descriptor
+    int fdCapacity;
+} EventLoop;
+
+void initFibers(VM *vm);
+void freeFibers(VM *vm);
+
+void startRootFiber(VM *vm, Chunk *chunk);
+bool spawnFiber(VM *vm, const char *source, int length);
+void resetFibers(VM *vm);
+
+/*
+Natives never block the VM. A native that has to wait parks the
+running fiber with one of the calls below and returns. The VM then
+runs the call again once the fiber is woken, and this time
+fiberResumed() tells the native to finish the job.
+*/
+bool fiberResumed(VM *vm);
+void yieldFiber(VM *vm);
+void sleepFiber(VM *vm, double ms);
+int waitForFd(VM *vm, int fd, bool writable);
+
+// Used by run(): switch to the next fiber that can run, waiting on
+// the event loop if needed. False when nothing is left to run.
+bool switchFiber(VM *vm);
+bool finishFiber(VM *vm);
+
+void addPipe(EventLoop *loop, int readFd, int writeFd);
+int getPipeWriter(EventLoop *loop, int readFd);
+void forgetFd(EventLoop *loop, int fd);
+
+#endif
@@ -6,20 +6,52 @@ from collections import deque
 ROOT_DIR = Path(os.getcwd())
 TEMPLATE = """# Compiler and flags
 CC = gcc
-CFLAGS = -Wall -std=c99 -O3
-LDFLAGS =
+CFLAGS = -Wall -std=c99 -O3 -fPIC -fno-semantic-interposition -pthread
+LDFLAGS = -pthread
 
 # Targets
 TARGET = {target}
 OBJS = {objs}
+LIB_OBJS = $(filter-out {target}.o, $(OBJS))
+BENCHES = $(patsubst %.c,%,$(wildcard bench/*.c))
+TESTS = $(patsubst %.c,%,$(wildcard test/*.c))
 
 # Default target
-all: $(TARGET)
+all: $(TARGET) liblox.a liblox.so
 
 # Link the final executable
 $(TARGET): $(OBJS)
 	$(CC) $(LDFLAGS) -o $@ $^
 
+# The interpreter with the opcode profiler compiled in, see profile.h
+$(TARGET)-profile: $(OBJS:.o=.c)
+	$(CC) $(CFLAGS) -DPROFILE_OPCODES $(LDFLAGS) -o $@ $^
+
+# Embedding library, see lox.h
+liblox.a: $(LIB_OBJS)
+	ar rcs $@ $^
+
+liblox.so: $(LIB_OBJS)
+	$(CC) -shared $(LDFLAGS) -o $@ $^
+
+# C microbenchmarks, one program per file in bench/
+bench: $(BENCHES)
+
+bench/%: bench/%.c liblox.a
+	$(CC) $(CFLAGS) -I. -o $@ $< liblox.a $(LDFLAGS)
+
+# Whole-program benchmarks against jlox, see ../bench/run.py
+bench-lox: $(TARGET)
+	python3 ../bench/run.py --clox $(TARGET)
+
+# Regression tests: the Lox scripts in test/ against the output they
+# expect, and C drivers for what a script can't reach, see test/run.py
+test: $(TARGET) $(TESTS)
+	python3 test/run.py ./$(TARGET) $(TESTS)
+
+test/%: test/%.c liblox.a
+	$(CC) $(CFLAGS) -I. -o $@ $< liblox.a $(LDFLAGS)
+
 # Compile source files into object files
 %.o: %.c
 	$(CC) $(CFLAGS) -c $< -o $@
@@ -29,9 +61,9 @@ $(TARGET): $(OBJS)
 
 # Clean up build artifacts
 clean:
-	rm -rf $(OBJS) $(TARGET)
+	rm -rf $(OBJS) $(TARGET) $(TARGET)-profile liblox.a liblox.so $(BENCHES) $(TESTS)
 
-.PHONY: all clean"""
+.PHONY: all bench bench-lox test clean"""
 
 
 def find_includes(path: str):
@@ -91,18 +123,20 @@ def find_includes(path: str):
     )
 
 
-def generate_makefile(exe: str, exe_target: str):
+def generate_makefile(roots: list, exe_target: str):
     objs, depends = set(), {}
+    includes = deque([])
 
-    target, includes = find_includes(exe)
-    if target is None:
-        return
+    for root in roots:
+        target, root_includes = find_includes(root)
+        if target is None:
+            continue
 
-    objs.add(target)
-    depends.update({target: includes})
+        objs.add(target)
+        depends.update({target: root_includes})
+        includes.extend(root_includes)
 
     visit = set()
-    includes = deque(includes)
 
     while includes:
         cur_visit = includes.popleft()
@@ -123,12 +157,16 @@ def generate_makefile(exe: str, exe_target: str):
 
     template = TEMPLATE.format(
         target=exe_target,
-        objs=" ".join(objs),
-        depends="\n".join([f"{k}: {' '.join(v)}" for k, v in depends.items()]),
+        objs=" ".join(sorted(objs)),
+        depends="\n".join([f"{k}: {' '.join(v)}" for k, v in sorted(depends.items())]),
     )
 
     with open("makefile", "w+") as file:
         file.write(template)
 
 
-generate_makefile(os.path.join(str(ROOT_DIR), "main.c"), "main")
+# main.c pulls in the interpreter, lox.c adds the embedding API
+generate_makefile(
+    [os.path.join(str(ROOT_DIR), "main.c"), os.path.join(str(ROOT_DIR), "lox.c")],
+    "main",
+)
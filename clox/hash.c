@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+static HashMode mode = HASH_FAST;
+static uint64_t secret[2];
+
+// Fill the SipHash key from the kernel, falling back to the clock
+// and an address if /dev/urandom is not there (chroots, sandboxes).
+static void seedSecret()
+{
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random != NULL)
+    {
+        size_t read = fread(secret, sizeof(secret), 1, random);
+        fclose(random);
+        if (read == 1)
+            return;
+    }
+
+    secret[0] = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ull;
+    secret[1] = (uint64_t)(uintptr_t)&secret ^ (uint64_t)clock();
+}
+
+void setHashMode(HashMode newMode)
+{
+    if (newMode == HASH_KEYED)
+        seedSecret();
+    mode = newMode;
+}
+
+uint32_t hashString(const char *key, int length)
+{
+    uint64_t hash = mode == HASH_KEYED ? sipHash(key, length, secret) : fastHash(key, length, 0);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// The full 128-bit product of two 64-bit numbers, as in number.c
+static inline void multiply(uint64_t a, uint64_t b, uint64_t *high, uint64_t *low)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#else
+    uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+    uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+    uint64_t lowLow = aLow * bLow;
+    uint64_t highLow = aHigh * bLow;
+    uint64_t lowHigh = aLow * bHigh;
+    uint64_t middle = (lowLow >> 32) + (uint32_t)highLow + (uint32_t)lowHigh;
+    *high = aHigh * bHigh + (highLow >> 32) + (lowHigh >> 32) + (middle >> 32);
+    *low = (middle << 32) | (uint32_t)lowLow;
+#endif
+}
+
+// Multiply into 128 bits and fold the halves together
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    uint64_t high, low;
+    multiply(a, b, &high, &low);
+    return low ^ high;
+}
+
+#define P0 0xa0761d6478bd642full
+#define P1 0xe7037ed1a0b428dbull
+#define P2 0x8ebc6af09c88c6e3ull
+#define P3 0x589965cc75374cc3ull
+
+/*
+A wyhash-style hash: the input goes in 16 bytes per multiply (48 with
+three independent lanes for long strings), and short strings, which is
+nearly all of them, are read with a couple of overlapping loads and
+no loop at all.
+*/
+uint64_t fastHash(const void *key, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a, b;
+    seed ^= mix(seed ^ P0, P1);
+
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            // Two pairs of possibly overlapping 4-byte reads cover it
+            size_t middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        }
+        else if (length > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t left = length;
+        if (left > 48)
+        {
+            uint64_t seed1 = seed, seed2 = seed;
+            do
+            {
+                seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ P2, read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ P3, read64(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (left > 16)
+        {
+            seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+
+        // The last 16 bytes, overlapping what was already mixed in
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+
+    uint64_t high, low;
+    multiply(a ^ P1, b ^ seed, &high, &low);
+    return mix(low ^ P0 ^ length, high ^ P1);
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND         \
+    do                    \
+    {                     \
+        v0 += v1;         \
+        v1 = ROTL(v1, 13); \
+        v1 ^= v0;         \
+        v0 = ROTL(v0, 32); \
+        v2 += v3;         \
+        v3 = ROTL(v3, 16); \
+        v3 ^= v2;         \
+        v0 += v3;         \
+        v3 = ROTL(v3, 21); \
+        v3 ^= v0;         \
+        v2 += v1;         \
+        v1 = ROTL(v1, 17); \
+        v1 ^= v2;         \
+        v2 = ROTL(v2, 32); \
+    } while (false)
+
+/*
+SipHash-1-3: one compression round per 8-byte word and three to
+finish, the variant Rust and CPython settled on for hash tables. It
+is a keyed PRF, so without the key nobody can predict which strings
+collide.
+*/
+uint64_t sipHash(const void *key, size_t length, const uint64_t secret[2])
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t v0 = secret[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = secret[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = secret[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = secret[1] ^ 0x7465646279746573ull;
+
+    const uint8_t *end = p + (length & ~(size_t)7);
+    for (; p != end; p += 8)
+    {
+        uint64_t m = read64(p);
+        v3 ^= m;
+        SIP_ROUND;
+        v0 ^= m;
+    }
+
+    // The tail goes in with the length in the top byte
+    uint64_t last = (uint64_t)length << 56;
+    switch (length & 7)
+    {
+    case 7:
+        last |= (uint64_t)p[6] << 48; // fall through
+    case 6:
+        last |= (uint64_t)p[5] << 40; // fall through
+    case 5:
+        last |= (uint64_t)p[4] << 32; // fall through
+    case 4:
+        last |= (uint64_t)p[3] << 24; // fall through
+    case 3:
+        last |= (uint64_t)p[2] << 16; // fall through
+    case 2:
+        last |= (uint64_t)p[1] << 8; // fall through
+    case 1:
+        last |= (uint64_t)p[0];
+    }
+
+    v3 ^= last;
+    SIP_ROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
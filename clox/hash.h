@@ -0,0 +1,30 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+/*
+String hashing for the intern table and every other Table.
+
+The default is a fast unkeyed hash that eats the string eight bytes
+at a time. Anyone who can choose the strings can also make them
+collide, though, so hosts that intern untrusted input can switch the
+whole process over to SipHash with a random key instead.
+
+The mode has to be picked before the first VM is created: every
+interned string caches its hash, and all VMs must agree on it.
+*/
+typedef enum
+{
+    HASH_FAST,
+    HASH_KEYED,
+} HashMode;
+
+void setHashMode(HashMode mode);
+uint32_t hashString(const char *key, int length);
+
+// The two hash functions, exposed for bench/hash.c
+uint64_t fastHash(const void *key, size_t length, uint64_t seed);
+uint64_t sipHash(const void *key, size_t length, const uint64_t secret[2]);
+
+#endif
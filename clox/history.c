@@ -0,0 +1,442 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "history.h"
+#include "object.h"
+#include "vm.h"
+
+#define TEXT_MAX 40   // Characters of a string shown in the stack
+#define STACK_DUMP 32 // Slots shown from the top of the stack
+
+static __thread VM *running;
+
+void initHistory(History *history)
+{
+    memset(history->transfers, 0, sizeof(history->transfers));
+    history->next = 0;
+    history->record = false;
+}
+
+void setPostMortem(VM *vm, bool on)
+{
+    // Transfers left over from an earlier stretch of recording would
+    // be decoded as if they led up to the current position
+    if (!on)
+        vm->history.next = 0;
+    vm->history.record = on;
+}
+
+VM *swapRunningVM(VM *vm)
+{
+    VM *previous = running;
+    running = vm;
+    return previous;
+}
+
+// Writer --------------------------------------------------------------------
+
+// printf() may take locks and allocate, which a signal handler can't,
+// so dumps format everything by hand into a buffer of their own
+typedef struct
+{
+    int fd;
+    int count;
+    char chars[512];
+} Writer;
+
+static void flushWriter(Writer *writer)
+{
+    int written = 0;
+    while (written < writer->count)
+    {
+        ssize_t result = write(writer->fd, writer->chars + written, writer->count - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+        written += (int)result;
+    }
+    writer->count = 0;
+}
+
+static void putChars(Writer *writer, const char *chars, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        if (writer->count == (int)sizeof(writer->chars))
+            flushWriter(writer);
+        writer->chars[writer->count++] = chars[i];
+    }
+}
+
+static void putString(Writer *writer, const char *string)
+{
+    putChars(writer, string, (int)strlen(string));
+}
+
+// Right aligned in `width` characters, padded with `pad`
+static void putInteger(Writer *writer, unsigned long long value, int width, char pad)
+{
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (int i = count; i < width; i++)
+        putChars(writer, &pad, 1);
+    while (count > 0)
+        putChars(writer, &digits[--count], 1);
+}
+
+// Up to six decimals, close to what `print` shows but not always the
+// same digits
+static void putNumber(Writer *writer, double number)
+{
+    if (number != number)
+    {
+        putString(writer, "nan");
+        return;
+    }
+    if (number < 0)
+    {
+        putChars(writer, "-", 1);
+        number = -number;
+    }
+    if (number - number != 0)
+    {
+        putString(writer, "inf");
+        return;
+    }
+
+    if (number >= 1e18)
+    {
+        int exponent = 0;
+        while (number >= 10)
+        {
+            number /= 10;
+            exponent++;
+        }
+        putNumber(writer, number);
+        putString(writer, "e+");
+        putInteger(writer, exponent, 0, ' ');
+        return;
+    }
+
+    unsigned long long whole = (unsigned long long)number;
+    unsigned long long fraction = (unsigned long long)((number - whole) * 1e6 + 0.5);
+    if (fraction >= 1000000)
+    {
+        whole++;
+        fraction = 0;
+    }
+    putInteger(writer, whole, 0, ' ');
+    if (fraction == 0)
+        return;
+
+    int width = 6;
+    while (fraction % 10 == 0)
+    {
+        fraction /= 10;
+        width--;
+    }
+    putChars(writer, ".", 1);
+    putInteger(writer, fraction, width, '0');
+}
+
+static void putText(Writer *writer, const char *chars, int length)
+{
+    putChars(writer, "\"", 1);
+    putChars(writer, chars, length < TEXT_MAX ? length : TEXT_MAX);
+    putString(writer, length > TEXT_MAX ? "\"..." : "\"");
+}
+
+static void putValue(Writer *writer, Value value)
+{
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        putString(writer, AS_BOOL(value) ? "true" : "false");
+        break;
+    case VAL_NIL:
+        putString(writer, "nil");
+        break;
+    case VAL_NUMBER:
+        putNumber(writer, AS_NUMBER(value));
+        break;
+    case VAL_SHORT_STRING:
+        putText(writer, value.as.chars, value.length);
+        break;
+    case VAL_OBJ:
+        switch (OBJ_TYPE(value))
+        {
+        case OBJ_CHANNEL:
+            putString(writer, "<channel>");
+            break;
+        case OBJ_EXTERNAL:
+            putText(writer, AS_EXTERNAL(value)->chars, AS_EXTERNAL(value)->length);
+            break;
+        case OBJ_NATIVE:
+            putString(writer, "<native fn ");
+            putString(writer, AS_NATIVE(value)->name);
+            putString(writer, ">");
+            break;
+        case OBJ_ROPE:
+            // Flattening it would allocate
+            if (AS_ROPE(value)->chars != NULL)
+                putText(writer, AS_ROPE(value)->chars, AS_ROPE(value)->length);
+            else
+            {
+                putString(writer, "<rope of ");
+                putInteger(writer, AS_ROPE(value)->length, 0, ' ');
+                putString(writer, " characters>");
+            }
+            break;
+        case OBJ_STRING:
+            putText(writer, AS_STRING(value)->chars, AS_STRING(value)->length);
+            break;
+        }
+        break;
+    }
+}
+
+// Recalling instructions ----------------------------------------------------
+
+typedef struct
+{
+    const uint8_t *ip;
+    Chunk *chunk;
+} Executed;
+
+static bool contains(Chunk *chunk, const uint8_t *ip)
+{
+    return chunk->code != NULL && ip >= chunk->code && ip < chunk->code + chunk->count;
+}
+
+// The live chunk `ip` points into, NULL if its chunk is gone
+static Chunk *chunkOf(VM *vm, const uint8_t *ip)
+{
+    if (ip == NULL)
+        return NULL;
+    if (vm->chunk != NULL && contains(vm->chunk, ip))
+        return vm->chunk;
+    if (contains(&vm->script, ip))
+        return &vm->script;
+
+    // Bounded, in case we got here because memory is trashed
+    int fibers = 0;
+    for (Fiber *fiber = vm->loop.live; fiber != NULL && fibers < 4096; fiber = fiber->nextLive, fibers++)
+    {
+        if (contains(&fiber->code, ip))
+            return &fiber->code;
+    }
+    return NULL;
+}
+
+/*
+Walks the transfers from the newest back, decoding the straight run
+of instructions that followed each one, until HISTORY_DUMP are found
+or a run can't be decoded any more. Returns how many, newest first.
+
+Params
+------
+- stop: where the newest run ended, exclusive. When it is not inside
+        that run, only the run's first instruction is listed.
+*/
+static int recall(VM *vm, const uint8_t *stop, Executed *executed)
+{
+    History *history = &vm->history;
+    uint32_t next = history->next;
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    uint32_t oldest = next > HISTORY_SIZE ? next - HISTORY_SIZE : 0;
+
+    int count = 0;
+    const uint8_t *source = NULL;  // The last instruction of the run being decoded
+    const uint8_t *resumed = NULL; // Where the newer run() started
+    for (uint32_t i = next; i > oldest && count < HISTORY_DUMP; i--)
+    {
+        Transfer *transfer = &history->transfers[(i - 1) % HISTORY_SIZE];
+        const uint8_t *from = (const uint8_t *)transfer->from;
+        const uint8_t *to = (const uint8_t *)transfer->to;
+        Chunk *chunk = chunkOf(vm, to);
+        if (chunk == NULL)
+            break;
+
+        const uint8_t *end;
+        if (i == next)
+        {
+            end = stop;
+            if (end == NULL || end <= to || end > chunk->code + chunk->count)
+                end = to + instructionLength(*to);
+        }
+        else if (resumed != NULL)
+        {
+            // The run before a run() starts only counts if it yielded
+            // right where the next one picked up
+            if (to != resumed)
+                break;
+            end = resumed;
+        }
+        else
+        {
+            if (!contains(chunk, source) || source < to)
+                break;
+            end = source + instructionLength(*source);
+        }
+
+        // Decode the run, keeping the last instructions only
+        const uint8_t *window[HISTORY_DUMP];
+        int decoded = 0;
+        const uint8_t *ip = to;
+        while (ip < end)
+        {
+            window[decoded++ % HISTORY_DUMP] = ip;
+            ip += instructionLength(*ip);
+        }
+        if (i != next && ip != end)
+            break;
+
+        for (int j = 0; j < decoded && count < HISTORY_DUMP; j++)
+        {
+            executed[count].ip = window[(decoded - 1 - j) % HISTORY_DUMP];
+            executed[count].chunk = chunk;
+            count++;
+        }
+
+        source = from;
+        resumed = from == NULL ? to : NULL;
+    }
+    return count;
+}
+
+static void putInstruction(Writer *writer, VM *vm, Executed *executed)
+{
+    Chunk *chunk = executed->chunk;
+    int offset = (int)(executed->ip - chunk->code);
+    uint8_t opcode = *executed->ip;
+    const char *name = opcodeName(opcode);
+
+    putString(writer, chunk == &vm->script ? "script " : "fiber  ");
+    putInteger(writer, offset, 4, '0');
+    putChars(writer, " ", 1);
+    putInteger(writer, chunk->lines[offset], 4, ' ');
+    putChars(writer, " ", 1);
+    putString(writer, name == NULL ? "?" : name);
+
+    int length = instructionLength(opcode);
+    if (offset + length > chunk->count)
+        length = 1;
+    if (length == 2)
+    {
+        putChars(writer, " ", 1);
+        putInteger(writer, chunk->code[offset + 1], 0, ' ');
+    }
+    else if (length == 3)
+    {
+        int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        int target = offset + 3 + (opcode == OP_LOOP ? -jump : jump);
+        putString(writer, " -> ");
+        putInteger(writer, target < 0 ? 0 : target, 0, ' ');
+    }
+    putChars(writer, "\n", 1);
+}
+
+void dumpHistory(VM *vm, int fd, const char *why)
+{
+    Writer writer;
+    writer.fd = fd;
+    writer.count = 0;
+
+    putString(&writer, "== post-mortem: ");
+    putString(&writer, why);
+    putString(&writer, " ==\n");
+
+    Executed executed[HISTORY_DUMP];
+    int count = recall(vm, vm->ip, executed);
+    putString(&writer, "last ");
+    putInteger(&writer, count, 0, ' ');
+    putString(&writer, " instructions, oldest first:\n");
+    for (int i = count - 1; i >= 0; i--)
+        putInstruction(&writer, vm, &executed[i]);
+    if (count == 0 && !vm->history.record)
+        putString(&writer, "     (not recorded)\n");
+
+    int depth = vm->stack == NULL ? 0 : (int)(vm->stackTop - vm->stack);
+    putString(&writer, "stack, ");
+    putInteger(&writer, depth, 0, ' ');
+    putString(&writer, " values, top last:\n");
+    if (depth > STACK_DUMP)
+    {
+        putString(&writer, "     ... ");
+        putInteger(&writer, depth - STACK_DUMP, 0, ' ');
+        putString(&writer, " more\n");
+    }
+    for (int slot = depth > STACK_DUMP ? depth - STACK_DUMP : 0; slot < depth; slot++)
+    {
+        putInteger(&writer, slot, 8, ' ');
+        putChars(&writer, " ", 1);
+        putValue(&writer, vm->stack[slot]);
+        putChars(&writer, "\n", 1);
+    }
+
+    flushWriter(&writer);
+}
+
+// Signals -------------------------------------------------------------------
+
+static void dumpRunning(int signal, const char *why)
+{
+    int saved = errno;
+    if (running != NULL)
+        dumpHistory(running, STDERR_FILENO, why);
+    else if (signal == SIGUSR1)
+    {
+        const char *message = "== post-mortem: no script running on this thread ==\n";
+        ssize_t ignored = write(STDERR_FILENO, message, strlen(message));
+        (void)ignored;
+    }
+    errno = saved;
+}
+
+static void onFatal(int signal)
+{
+    dumpRunning(signal, signal == SIGSEGV   ? "SIGSEGV"
+                        : signal == SIGBUS  ? "SIGBUS"
+                        : signal == SIGILL  ? "SIGILL"
+                        : signal == SIGFPE  ? "SIGFPE"
+                                            : "SIGABRT");
+    // SA_RESETHAND has put the default action back
+    raise(signal);
+}
+
+static void onRequest(int signal)
+{
+    dumpRunning(signal, "SIGUSR1");
+}
+
+bool installCrashHandlers()
+{
+    static const int fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = onFatal;
+    action.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (int i = 0; i < (int)(sizeof(fatal) / sizeof(fatal[0])); i++)
+    {
+        if (sigaction(fatal[i], &action, NULL) != 0)
+            return false;
+    }
+
+    action.sa_handler = onRequest;
+    action.sa_flags = SA_RESTART;
+    return sigaction(SIGUSR1, &action, NULL) == 0;
+}
@@ -0,0 +1,95 @@
+#ifndef clox_history_h
+#define clox_history_h
+
+#include "common.h"
+
+/*
+A flight recorder for post-mortems: what the VM ran last, so that a
+runtime error or a crash can say more than one line number, without
+rerunning anything with --trace.
+
+Writing down every instruction would slow run() down by a third.
+The recorder notes control transfers instead, the way a CPU's last
+branch record does: each taken jump, loop and fiber switch, with the
+ip it left from and the ip it went to. Between two transfers the VM
+runs straight through the bytecode, so the instructions it executed
+are recovered by decoding the chunk from one transfer's target up to
+the next transfer's source. That is two stores per taken branch and
+nothing on the others: the count of transfers stays in a register,
+and is written back to the VM along with the ip (at calls, errors and
+yields) and once per fuel slice.
+
+Even that much shows on tight loops, so only a VM that setPostMortem()
+turned recording on for runs the version of run() that records (the
+sampled and traced ones always do). The plain one has no history code
+at all, and its dumps only show the stack.
+
+A dump lists the last HISTORY_DUMP instructions (offset, line and
+opcode) and the stack, and goes out through write(2) alone, so it is
+safe to call from a signal handler. It is written:
+
+- on a runtime error, when recording
+- on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT, once
+  installCrashHandlers() is called, before the process dies as usual
+- on SIGUSR1 (also installCrashHandlers()), for a script that hangs
+- whenever the host calls dumpHistory()
+
+The instructions come from the chunks still alive at the time of the
+dump, so the list stops at code of a fiber that has since finished.
+From a signal, the list ends at the last write-back. A crash inside a
+native sees the exact position, a signal landing in a tight loop may
+see one that is up to a fuel slice old, and the transfers that have
+been overwritten since then cut the list short.
+*/
+
+#define HISTORY_SIZE 256 // Transfers remembered, a power of two
+#define HISTORY_DUMP 64  // Instructions a dump lists at most
+
+// The ips are kept as integers: a store through a pointer type would
+// make the compiler reload every pointer run() holds in the VM
+typedef struct
+{
+    uintptr_t from; // 0 for the start of a run()
+    uintptr_t to;
+} Transfer;
+
+typedef struct
+{
+    Transfer transfers[HISTORY_SIZE];
+    uint32_t next; // Transfers recorded so far, as of the last write-back
+    bool record;   // Record, and dump on runtime errors
+} History;
+
+void initHistory(History *history);
+
+// run() counts transfers in a local and only writes `next` back now
+// and then, see above
+static inline void recordTransfer(History *history, uint32_t index,
+                                  const uint8_t *from, const uint8_t *to)
+{
+    Transfer *transfer = &history->transfers[index % HISTORY_SIZE];
+    transfer->from = (uintptr_t)from;
+    transfer->to = (uintptr_t)to;
+}
+
+static inline void publishTransfers(History *history, uint32_t next)
+{
+    // A handler interrupting this thread must never see the count
+    // before the transfers it counts
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    history->next = next;
+}
+
+// Turn recording, and the dumps on runtime errors, on or off. Takes
+// effect from the next resume().
+void setPostMortem(VM *vm, bool on);
+// Write the last instructions and the stack of `vm` to `fd`, headed
+// by `why` the dump was made
+void dumpHistory(VM *vm, int fd, const char *why);
+
+// The VM running on the calling thread, for the signal handlers.
+// Returns the one that was running before.
+VM *swapRunningVM(VM *vm);
+bool installCrashHandlers();
+
+#endif
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+// Plenty for a few hundred threads to rarely meet on the same lock
+#define SHARD_BITS 6
+#define SHARD_COUNT (1 << SHARD_BITS)
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Table strings; // The keys are the strings, the values unused
+} Shard;
+
+static Shard shards[SHARD_COUNT];
+static pthread_once_t shardsOnce = PTHREAD_ONCE_INIT;
+
+static void initShards()
+{
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        initTable(&shards[i].strings);
+    }
+}
+
+// A Table finds slots with the low bits of the hash, so shards are
+// picked with the top ones to keep the two independent.
+static Shard *lockShard(uint32_t hash)
+{
+    pthread_once(&shardsOnce, initShards);
+    Shard *shard = &shards[hash >> (32 - SHARD_BITS)];
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
+ObjString *internChars(const char *chars, int length, uint32_t hash)
+{
+    Shard *shard = lockShard(hash);
+    ObjString *string = tableFindString(&shard->strings, chars, length, hash);
+    if (string == NULL)
+    {
+        string = reserveString(length);
+        memcpy(string->chars, chars, length);
+        string->hash = hash;
+        tableSet(&shard->strings, string, NIL_VAL);
+    }
+    string->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
+
+ObjString *internReserved(ObjString *string)
+{
+    Shard *shard = lockShard(string->hash);
+    ObjString *interned = tableFindString(&shard->strings, string->chars, string->length, string->hash);
+    if (interned == NULL)
+    {
+        interned = string;
+        tableSet(&shard->strings, string, NIL_VAL);
+    }
+    interned->refs++;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (interned != string)
+        freeObject((Obj *)string);
+    return interned;
+}
+
+void retainString(ObjString *string)
+{
+    Shard *shard = lockShard(string->hash);
+    string->refs++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void releaseString(ObjString *string)
+{
+    Shard *shard = lockShard(string->hash);
+    if (--string->refs == 0)
+    {
+        tableDelete(&shard->strings, string);
+        freeObject((Obj *)string);
+
+        // Hand the memory back once the last VM using the shard is gone
+        if (shard->strings.count == 0)
+            freeTable(&shard->strings);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void releaseStrings(Table *strings)
+{
+    for (int i = 0; i < strings->capacity; i++)
+    {
+        // Empty and deleted slots have the top bit set
+        if (strings->control[i] & 0x80)
+            continue;
+        releaseString(strings->entries[i].key);
+    }
+}
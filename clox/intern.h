@@ -0,0 +1,38 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "table.h"
+
+/*
+The process-wide intern table. Every ObjString lives here, once,
+no matter how many VMs use it, so a hundred VMs running the same
+script share one copy of each identifier and two threads holding
+the same string hold the same pointer.
+
+The table is split into shards, each a Table behind its own mutex,
+picked by the top bits of the hash. A VM keeps the strings it has
+seen in `vm->strings`, which works as a lock-free cache in front of
+the shards: only a string that is new to the VM takes a lock.
+
+Strings are reference counted. Each VM holds one reference per
+string in its cache and drops them all in freeVM(), the last one out
+frees the string. The count only changes under the shard's lock, so
+a string found by a lookup can't be freed under the finder's feet.
+*/
+
+// Takes a reference to the string with these characters, copying
+// them into a new one if there's none yet
+ObjString *internChars(const char *chars, int length, uint32_t hash);
+
+// Same for a string from reserveString() with its hash set. It is
+// either added as is or freed in favour of the one already there.
+ObjString *internReserved(ObjString *string);
+
+void retainString(ObjString *string);
+void releaseString(ObjString *string);
+
+// Drop the reference held for every string in a VM's cache
+void releaseStrings(Table *strings);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "lox.h"
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "vm.h"
+
+static LoxResult toLoxResult(InterpretResult res)
+{
+    switch (res)
+    {
+    case INTERPRET_OK:
+        return LOX_OK;
+    case INTERPRET_COMPILE_ERROR:
+        return LOX_COMPILE_ERROR;
+    case INTERPRET_RUNTIME_ERROR:
+        return LOX_RUNTIME_ERROR;
+    case INTERPRET_YIELD:
+        return LOX_YIELD;
+    }
+    return LOX_RUNTIME_ERROR;
+}
+
+void loxUseKeyedHash(void)
+{
+    setHashMode(HASH_KEYED);
+}
+
+LoxVM *loxNewVM(void)
+{
+    VM *vm = ALLOCATE(VM, 1);
+    initVM(vm);
+    return vm;
+}
+
+void loxFreeVM(LoxVM *vm)
+{
+    freeVM(vm);
+    FREE(VM, vm);
+}
+
+void loxSetBudget(LoxVM *vm, int64_t fuel, int64_t timeoutMs)
+{
+    setBudget(vm, fuel, timeoutMs);
+}
+
+LoxResult loxCompile(LoxVM *vm, const char *source)
+{
+    return toLoxResult(loadScript(vm, source));
+}
+
+LoxResult loxRun(LoxVM *vm)
+{
+    return toLoxResult(resume(vm));
+}
+
+LoxResult loxInterpret(LoxVM *vm, const char *source)
+{
+    return toLoxResult(interpret(vm, source));
+}
+
+void loxSetOutput(LoxVM *vm, LoxWriteFn write, void *context, LoxFlush flush)
+{
+    // LoxFlush lists the policies in the same order
+    setOutput(&vm->output, write, context, (FlushPolicy)flush);
+}
+
+void loxFlushOutput(LoxVM *vm)
+{
+    flushOutput(&vm->output);
+}
+
+void loxDumpHistory(LoxVM *vm, int fd)
+{
+    dumpHistory(vm, fd, "requested");
+}
+
+void loxSetPostMortem(LoxVM *vm, bool on)
+{
+    setPostMortem(vm, on);
+}
+
+bool loxGetGlobal(LoxVM *vm, const char *name, LoxValue *out)
+{
+    Value value;
+    ObjString *key = copyString(vm, name, (int)strlen(name));
+    if (!tableGet(&vm->globals, key, &value))
+        return false;
+
+    memset(out, 0, sizeof(LoxValue));
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        out->type = LOX_BOOL;
+        out->boolean = AS_BOOL(value);
+        break;
+    case VAL_NUMBER:
+        out->type = LOX_NUMBER;
+        out->number = AS_NUMBER(value);
+        break;
+    case VAL_OBJ:
+    case VAL_SHORT_STRING:
+    {
+        // Strings are the only objects for now. External strings
+        // and flattened ropes already have characters that stay put,
+        // the rest are interned to get some.
+        if (IS_EXTERNAL(value) || IS_ROPE(value))
+        {
+            out->type = LOX_STRING;
+            out->string = textChars(&value);
+            out->length = textLength(value);
+            break;
+        }
+
+        ObjString *string = toObjString(vm, value);
+        out->type = LOX_STRING;
+        out->string = string->chars;
+        out->length = string->length;
+        break;
+    }
+    default:
+        out->type = LOX_NIL;
+        break;
+    }
+    return true;
+}
+
+void loxSetGlobalString(LoxVM *vm, const char *name, const char *chars, int length,
+                        LoxReleaseFn release, void *owner)
+{
+    ObjString *key = copyString(vm, name, (int)strlen(name));
+    tableSet(&vm->globals, key, externalString(vm, chars, length, release, owner));
+}
+
+// The public struct can't see table.h, so it spells the count out.
+// LoxTableStats.probes must match TableStats.probes: this array gets
+// a negative size, which fails the build, when they don't.
+typedef char loxProbeBucketsMatch[LOX_PROBE_BUCKETS == PROBE_BUCKETS ? 1 : -1];
+
+void loxTableStats(LoxVM *vm, LoxTable which, LoxTableStats *out)
+{
+    Table *table = which == LOX_TABLE_STRINGS ? &vm->strings : &vm->globals;
+    TableStats *stats = &table->stats;
+
+    out->count = table->count;
+    out->tombstones = table->tombstones;
+    out->capacity = table->capacity;
+    out->loadFactor = table->capacity == 0 ? 0 : (double)(table->count + table->tombstones) / table->capacity;
+
+    out->lookups = 0;
+    for (int i = 0; i < PROBE_BUCKETS; i++)
+    {
+        out->probes[i] = stats->probes[i];
+        out->lookups += stats->probes[i];
+    }
+    out->longestProbe = stats->longestProbe;
+    out->resizes = stats->resizes;
+    out->rehashes = stats->rehashes;
+    out->internHits = stats->stringHits;
+    out->internMisses = stats->stringMisses;
+}
+
+void loxWaitForTasks(void)
+{
+    waitForTasks();
+}
@@ -0,0 +1,125 @@
+#ifndef clox_lox_h
+#define clox_lox_h
+
+/*
+Embedding API. A host only needs this header and liblox.a / liblox.so.
+
+Every call takes the VM it works on. Apart from the choice of string
+hash and the interned strings, which every VM shares behind locks, the
+library keeps no global state. A host may create one VM per thread and
+run them in parallel. A single VM must not be used by two threads at
+the same time.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct VM LoxVM;
+
+typedef enum
+{
+    LOX_OK,
+    LOX_COMPILE_ERROR,
+    LOX_RUNTIME_ERROR,
+    LOX_YIELD, // Budget exhausted, call loxRun() to continue
+} LoxResult;
+
+typedef enum
+{
+    LOX_NIL,
+    LOX_BOOL,
+    LOX_NUMBER,
+    LOX_STRING,
+} LoxType;
+
+typedef struct
+{
+    LoxType type;
+    bool boolean;
+    double number;
+    const char *string; // Owned by the VM, valid until loxFreeVM(),
+    int length;         // and not always NUL terminated
+} LoxValue;
+
+// Hash strings with SipHash under a random per-process key, so that
+// untrusted input can't be crafted to collide. Call it before the
+// first loxNewVM(), it applies to the whole process.
+void loxUseKeyedHash(void);
+
+LoxVM *loxNewVM(void);
+void loxFreeVM(LoxVM *vm);
+void loxSetBudget(LoxVM *vm, int64_t fuel, int64_t timeoutMs);
+
+// Compile `source` without running it.
+LoxResult loxCompile(LoxVM *vm, const char *source);
+// Run (or continue) the compiled script.
+LoxResult loxRun(LoxVM *vm);
+// Compile and run in one go.
+LoxResult loxInterpret(LoxVM *vm, const char *source);
+
+typedef void (*LoxWriteFn)(void *context, const char *chars, size_t length);
+
+typedef enum
+{
+    LOX_FLUSH_LINE, // After every line printed
+    LOX_FLUSH_FULL, // When 64 KB are buffered and when loxRun() returns
+    LOX_FLUSH_EXIT, // Only on loxFlushOutput() and loxFreeVM()
+} LoxFlush;
+
+// Send what the script prints to `write` instead of stdout (NULL
+// goes back to stdout). By default output is line buffered on a
+// terminal and LOX_FLUSH_FULL otherwise.
+void loxSetOutput(LoxVM *vm, LoxWriteFn write, void *context, LoxFlush flush);
+void loxFlushOutput(LoxVM *vm);
+
+// Write the last instructions the VM ran and its stack to the file
+// descriptor `fd`, also from a signal handler. The instructions are
+// only recorded once loxSetPostMortem() turned it on, at a small cost
+// on every taken branch, which also dumps on every runtime error.
+void loxDumpHistory(LoxVM *vm, int fd);
+void loxSetPostMortem(LoxVM *vm, bool on);
+
+// Read a global variable left behind by the script.
+bool loxGetGlobal(LoxVM *vm, const char *name, LoxValue *out);
+
+typedef void (*LoxReleaseFn)(void *owner, const char *chars, int length);
+
+// Define a global string that uses the host's characters in place,
+// without copying or hashing them. They must stay valid and unchanged
+// until `release` (which may be NULL) is called with `owner`, at the
+// latest from loxFreeVM(). Scripts can print, compare and `+` such a
+// string for free; handing it to a native function interns a copy.
+void loxSetGlobalString(LoxVM *vm, const char *name, const char *chars, int length,
+                        LoxReleaseFn release, void *owner);
+
+typedef enum
+{
+    LOX_TABLE_STRINGS, // Interned strings
+    LOX_TABLE_GLOBALS,
+} LoxTable;
+
+#define LOX_PROBE_BUCKETS 6
+
+typedef struct
+{
+    int count;
+    int tombstones;
+    int capacity;
+    double loadFactor; // Entries and tombstones over capacity
+    uint64_t lookups;
+    uint64_t probes[LOX_PROBE_BUCKETS]; // Lookups that probed 1, 2, 3-4, 5-8, 9-16, 17+ groups
+    int longestProbe;
+    uint64_t resizes;
+    uint64_t rehashes;
+    uint64_t internHits; // Only for LOX_TABLE_STRINGS
+    uint64_t internMisses;
+} LoxTableStats;
+
+// How one of the VM's hash tables is doing, counted since loxNewVM().
+void loxTableStats(LoxVM *vm, LoxTable which, LoxTableStats *out);
+
+// Wait for every script started with spawn() to finish.
+void loxWaitForTasks(void);
+
+#endif
@@ -1,13 +1,21 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "chunk.h"
+#include "counters.h"
 #include "vm.h"
 #include "debug.h"
+#include "hash.h"
+#include "history.h"
+#include "pool.h"
+#include "sampler.h"
+#include "trace.h"
+#include "table.h"
 
-static void repl()
+static void repl(VM *vm)
 {
     char line[1024];
     for (;;)
@@ -20,7 +28,8 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        if (interpret(vm, line) == INTERPRET_YIELD)
+            fprintf(stderr, "Execution budget exhausted.\n");
     }
 }
 
@@ -56,33 +65,196 @@ static char *readFile(const char *path)
     return buffer;
 }
 
-static void runFile(const char *path)
+// Returns the exit status
+static int runFile(VM *vm, const char *path)
 {
+    traceBegin("read");
     char *source = readFile(path);
-    InterpretResult res = interpret(source);
+    traceEnd("read");
+    InterpretResult res = interpret(vm, source);
     free(source);
 
     if (res == INTERPRET_COMPILE_ERROR)
-        exit(65);
+        return 65;
     if (res == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+        return 70;
+    if (res == INTERPRET_YIELD)
+    {
+        // The command line has nothing else to schedule,
+        // so running out of budget ends the script.
+        fprintf(stderr, "Execution budget exhausted.\n");
+        return 75;
+    }
+    return 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--fuel=N] [--timeout=MS] [--keyed-hash] [--table-stats]\n"
+                    "            [--flush=line|full|exit] [--profile=PATH] [--timeline=PATH]\n"
+                    "            [--hw-counters] [--disassemble] [--trace] [--trace-lines=A-B]\n"
+                    "            [--post-mortem] [path]\n");
+#ifdef PROFILE_OPCODES
+    fprintf(stderr, "            [--opcode-json=PATH]\n");
+#endif
+    exit(64);
 }
 
+#ifdef PROFILE_OPCODES
+// The table goes to stderr, the JSON version to `jsonPath` if given
+static void reportProfile(VM *vm, const char *jsonPath)
+{
+    printProfile(stderr, &vm->profile);
+    if (jsonPath == NULL)
+        return;
+
+    FILE *file = fopen(jsonPath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot write file \"%s\".\n", jsonPath);
+        return;
+    }
+    printProfileJson(file, &vm->profile);
+    fclose(file);
+}
+#endif
+
 int main(int argc, const char *argv[])
 {
-    initVM();
+    const char *path = NULL;
+    int64_t fuel = -1, timeoutMs = 0;
+    bool tableStats = false;
+    int flush = -1; // Leave the default
+    const char *samplePath = NULL;
+    const char *timelinePath = NULL;
+    bool hwCounters = false;
+    bool disassemble = false, trace = false;
+    int firstLine = 0, lastLine = INT_MAX;
+    bool postMortem = false;
+#ifdef PROFILE_OPCODES
+    const char *jsonPath = NULL;
+#endif
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--fuel=", 7) == 0)
+            fuel = strtoll(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--timeout=", 10) == 0)
+            timeoutMs = strtoll(argv[i] + 10, NULL, 10);
+        else if (strcmp(argv[i], "--keyed-hash") == 0)
+            setHashMode(HASH_KEYED);
+        else if (strcmp(argv[i], "--table-stats") == 0)
+            tableStats = true;
+        else if (strcmp(argv[i], "--flush=line") == 0)
+            flush = FLUSH_LINE;
+        else if (strcmp(argv[i], "--flush=full") == 0)
+            flush = FLUSH_FULL;
+        else if (strcmp(argv[i], "--flush=exit") == 0)
+            flush = FLUSH_EXIT;
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+            samplePath = argv[i] + 10;
+        else if (strncmp(argv[i], "--timeline=", 11) == 0)
+            timelinePath = argv[i] + 11;
+        else if (strcmp(argv[i], "--hw-counters") == 0)
+            hwCounters = true;
+        else if (strcmp(argv[i], "--disassemble") == 0)
+            disassemble = true;
+        else if (strcmp(argv[i], "--trace") == 0)
+            trace = true;
+        else if (strncmp(argv[i], "--trace-lines=", 14) == 0)
+        {
+            // A range like 10-20, or a single line
+            int fields = sscanf(argv[i] + 14, "%d-%d", &firstLine, &lastLine);
+            if (fields < 1)
+                usage();
+            if (fields == 1)
+                lastLine = firstLine;
+            trace = true;
+        }
+        else if (strcmp(argv[i], "--post-mortem") == 0)
+            postMortem = true;
+#ifdef PROFILE_OPCODES
+        else if (strncmp(argv[i], "--opcode-json=", 14) == 0)
+            jsonPath = argv[i] + 14;
+#endif
+        else if (argv[i][0] == '-' || path != NULL)
+            usage();
+        else
+            path = argv[i];
+    }
 
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        runFile(argv[1]);
+    if (timelinePath != NULL && !startTrace(timelinePath))
+    {
+        fprintf(stderr, "Cannot write file \"%s\".\n", timelinePath);
+        exit(74);
+    }
+
+    // Only now, the hash mode has to be settled before any string
+    // is interned
+    VM vm;
+    initVM(&vm);
+    setBudget(&vm, fuel, timeoutMs);
+    setDiagnostics(&vm, disassemble, trace, firstLine, lastLine);
+    setPostMortem(&vm, postMortem);
+    // Crashes and SIGUSR1 always get a post-mortem, with the last
+    // instructions only under --post-mortem
+    if (!installCrashHandlers())
+        fprintf(stderr, "Cannot install the crash handlers.\n");
+    if (flush >= 0)
+        setOutput(&vm.output, NULL, NULL, (FlushPolicy)flush);
+    if (hwCounters && !openCounters())
+        fprintf(stderr, "No performance counters available.\n");
+#ifdef PROFILE_OPCODES
+    if (hwCounters && !profileCounters(&vm.profile))
+        fprintf(stderr, "Hardware counters can't be read from user space, not profiling opcodes with them.\n");
+#endif
+    if (samplePath != NULL && !startSampler(&vm))
+    {
+        fprintf(stderr, "Cannot start the sampling profiler.\n");
+        exit(71);
+    }
+
+    int status = 0;
+    if (path == NULL)
+        repl(&vm);
     else
+        status = runFile(&vm, path);
+
+    if (samplePath != NULL)
+    {
+        stopSampler();
+        if (!writeSamples(samplePath, path == NULL ? "repl" : path))
+            fprintf(stderr, "Cannot write file \"%s\".\n", samplePath);
+    }
+
+    if (tableStats)
+    {
+        printTableStats(stderr, "strings", &vm.strings);
+        printTableStats(stderr, "globals", &vm.globals);
+    }
+
+#ifdef PROFILE_OPCODES
+    reportProfile(&vm, jsonPath);
+#endif
+
+    if (counting)
+    {
+        printCounters(stderr);
+        closeCounters();
+    }
+
+    // A failed script takes whatever it spawned down with it
+    if (status != 0)
     {
-        fprintf(stderr, "Useage: clox [path]\n");
-        exit(64);
+        flushOutput(&vm.output);
+        stopTrace();
+        exit(status);
     }
 
-    freeVM();
+    // Spawned scripts keep the process alive
+    waitForTasks();
+    freeVM(&vm);
+    stopTrace();
 
     return 0;
 }
\ No newline at end of file
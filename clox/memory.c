@@ -1,10 +1,14 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "trace.h"
 #include "vm.h"
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
+    if (tracing)
+        traceAllocation((int64_t)newSize - (int64_t)oldSize);
+
     if (newSize == 0)
     {
         free(pointer);
@@ -21,19 +25,42 @@ void freeObject(Obj *object)
 {
     switch (object->type)
     {
+    case OBJ_CHANNEL:
+        releaseChannel(((ObjChannel *)object)->channel);
+        FREE(ObjChannel, object);
+        break;
+    case OBJ_EXTERNAL:
+    {
+        ObjExternal *external = (ObjExternal *)object;
+        if (external->release != NULL)
+            external->release(external->owner, external->chars, external->length);
+        FREE(ObjExternal, object);
+        break;
+    }
+    case OBJ_NATIVE:
+        FREE(ObjNative, object);
+        break;
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        if (rope->chars != NULL)
+            FREE_ARRAY(char, rope->chars, rope->length + 1);
+        FREE(ObjRope, object);
+        break;
+    }
     case OBJ_STRING:
     {
+        // The characters are part of the same allocation
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        reallocate(object, sizeof(ObjString) + string->length + 1, 0);
         break;
     }
     }
 }
 
-void freeObjects()
+void freeObjects(VM *vm)
 {
-    Obj *objects = vm.objects;
+    Obj *objects = vm->objects;
 
     while (objects != NULL)
     {
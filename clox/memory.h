@@ -25,6 +25,7 @@ Adding a group operation ensures the precedence.
     reallocate(pointer, sizeof(type), 0)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void freeObject(Obj *object);
+void freeObjects(VM *vm);
 
 #endif
\ No newline at end of file
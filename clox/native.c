@@ -0,0 +1,418 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "fiber.h"
+#include "intern.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "vm.h"
+
+#define SPAWN_CHANNEL_CAPACITY 64
+#define READ_CHUNK 4096
+
+// Turn a value of this VM into a message another VM can adopt
+static bool toMessage(VM *vm, Value value, Message *message)
+{
+    switch (value.type)
+    {
+    case VAL_NIL:
+        message->type = MSG_NIL;
+        return true;
+    case VAL_BOOL:
+        message->type = MSG_BOOL;
+        message->as.boolean = AS_BOOL(value);
+        return true;
+    case VAL_NUMBER:
+        message->type = MSG_NUMBER;
+        message->as.number = AS_NUMBER(value);
+        return true;
+    default:
+        // Strings arrive here as ObjStrings, see callValue()
+        break;
+    }
+
+    if (IS_STRING(value))
+    {
+        ObjString *string = AS_STRING(value);
+        retainString(string);
+        message->type = MSG_STRING;
+        message->as.string = string;
+        return true;
+    }
+
+    if (IS_CHANNEL(value))
+    {
+        ObjChannel *endpoint = AS_CHANNEL(value);
+        retainChannel(endpoint->channel);
+        message->type = MSG_CHANNEL;
+        message->as.endpoint.channel = endpoint->channel;
+        message->as.endpoint.side = endpoint->side;
+        return true;
+    }
+
+    runtimeError(vm, "Only numbers, booleans, nil, strings and channels can be sent.");
+    return false;
+}
+
+// Consumes the message
+static Value fromMessage(VM *vm, Message *message)
+{
+    switch (message->type)
+    {
+    case MSG_BOOL:
+        return BOOL_VAL(message->as.boolean);
+    case MSG_NUMBER:
+        return NUMBER_VAL(message->as.number);
+    case MSG_STRING:
+        // Same string, no copy
+        return OBJ_VAL(adoptString(vm, message->as.string));
+    case MSG_CHANNEL:
+        return OBJ_VAL(newChannel(vm, message->as.endpoint.channel, message->as.endpoint.side));
+    default:
+        return NIL_VAL;
+    }
+}
+
+// spawn(source): run `source` on a pool thread in a VM of its own.
+// Returns one end of a channel, the spawned script sees the other
+// end as its global `channel`.
+static bool spawnNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]))
+    {
+        runtimeError(vm, "spawn() expects the source of a script.");
+        return false;
+    }
+
+    ObjString *source = AS_STRING(args[0]);
+    Channel *channel = openChannel(SPAWN_CHANNEL_CAPACITY);
+
+    Task task;
+    task.source = ALLOCATE(char, source->length + 1);
+    memcpy(task.source, source->chars, source->length + 1);
+    task.channel = channel;
+    retainChannel(channel);
+    if (!submitTask(task))
+    {
+        // Both the task's reference and the one we would have kept
+        FREE_ARRAY(char, task.source, source->length + 1);
+        releaseChannel(channel);
+        releaseChannel(channel);
+        runtimeError(vm, "Cannot start a thread for spawn().");
+        return false;
+    }
+
+    args[-1] = OBJ_VAL(newChannel(vm, channel, 0));
+    return true;
+}
+
+// send(channel, value): blocks while the channel is full
+static bool sendNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_CHANNEL(args[0]))
+    {
+        runtimeError(vm, "Can only send to a channel.");
+        return false;
+    }
+
+    Message message;
+    if (!toMessage(vm, args[1], &message))
+        return false;
+
+    ObjChannel *endpoint = AS_CHANNEL(args[0]);
+    enterBlocking();
+    bool sent = channelSend(endpoint->channel, endpoint->side, message);
+    leaveBlocking();
+
+    if (!sent)
+    {
+        freeMessage(&message);
+        runtimeError(vm, "Send on a closed channel.");
+        return false;
+    }
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// receive(channel): blocks while the channel is empty, returns nil
+// once the channel is closed and drained. Channels block the whole
+// thread, fibers only help with descriptors and timers.
+static bool receiveNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_CHANNEL(args[0]))
+    {
+        runtimeError(vm, "Can only receive from a channel.");
+        return false;
+    }
+
+    Message message;
+    ObjChannel *endpoint = AS_CHANNEL(args[0]);
+    enterBlocking();
+    bool received = channelReceive(endpoint->channel, endpoint->side, &message);
+    leaveBlocking();
+
+    if (!received)
+    {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+
+    args[-1] = fromMessage(vm, &message);
+    return true;
+}
+
+// fiber(source): run `source` concurrently with the caller, sharing
+// its globals. It starts the next time the running fiber waits.
+static bool fiberNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]))
+    {
+        runtimeError(vm, "fiber() expects the source of a script.");
+        return false;
+    }
+
+    ObjString *source = AS_STRING(args[0]);
+    if (!spawnFiber(vm, source->chars, source->length))
+    {
+        runtimeError(vm, "Could not compile fiber.");
+        return false;
+    }
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// yield(): let the other ready fibers run
+static bool yieldNative(VM *vm, int argCount, Value *args)
+{
+    if (!fiberResumed(vm))
+    {
+        yieldFiber(vm);
+        return true;
+    }
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// sleep(ms): park the fiber on a timer
+static bool sleepNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]))
+    {
+        runtimeError(vm, "sleep() expects milliseconds.");
+        return false;
+    }
+
+    if (!fiberResumed(vm))
+    {
+        sleepFiber(vm, AS_NUMBER(args[0]));
+        return true;
+    }
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool toFd(VM *vm, Value value, int *fd)
+{
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0)
+    {
+        runtimeError(vm, "Expect a file descriptor.");
+        return false;
+    }
+
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+// Returns true if the caller may go ahead with the I/O right now.
+// Otherwise the fiber is parked (or an error was reported).
+static bool awaitFd(VM *vm, int fd, bool writable, bool *failed)
+{
+    *failed = false;
+    if (fiberResumed(vm))
+        return true;
+
+    struct pollfd probe = {fd, writable ? POLLOUT : POLLIN, 0};
+    if (poll(&probe, 1, 0) > 0)
+        return true;
+
+    int parked = waitForFd(vm, fd, writable);
+    if (parked < 0)
+    {
+        runtimeError(vm, "Cannot wait on descriptor %d: %s.", fd, strerror(errno));
+        *failed = true;
+        return false;
+    }
+    return parked == 0;
+}
+
+// The I/O found `fd` drained (or full) after all, somebody else got
+// there first. Park again, or, where epoll can't watch `fd`, go round
+// the ready queue once and try again.
+static bool awaitAgain(VM *vm, int fd, bool writable)
+{
+    int parked = waitForFd(vm, fd, writable);
+    if (parked < 0)
+    {
+        runtimeError(vm, "Cannot wait on descriptor %d: %s.", fd, strerror(errno));
+        return false;
+    }
+    if (parked == 0)
+        yieldFiber(vm);
+    return true;
+}
+
+// pipe(): returns the read end of a new pipe, see pipeWriter()
+static bool pipeNative(VM *vm, int argCount, Value *args)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        runtimeError(vm, "Cannot create pipe: %s.", strerror(errno));
+        return false;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    addPipe(&vm->loop, fds[0], fds[1]);
+
+    args[-1] = NUMBER_VAL(fds[0]);
+    return true;
+}
+
+// pipeWriter(fd): the write end of the pipe read through `fd`
+static bool pipeWriterNative(VM *vm, int argCount, Value *args)
+{
+    int fd;
+    if (!toFd(vm, args[0], &fd))
+        return false;
+
+    int writer = getPipeWriter(&vm->loop, fd);
+    args[-1] = writer < 0 ? NIL_VAL : NUMBER_VAL(writer);
+    return true;
+}
+
+// open(path): open a file for reading
+static bool openNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]))
+    {
+        runtimeError(vm, "open() expects a path.");
+        return false;
+    }
+
+    int fd = open(AS_CSTRING(args[0]), O_RDONLY | O_NONBLOCK);
+    args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+    return true;
+}
+
+// read(fd): wait for data, returns a string or nil at end of file
+static bool readNative(VM *vm, int argCount, Value *args)
+{
+    int fd;
+    bool failed;
+    if (!toFd(vm, args[0], &fd))
+        return false;
+    if (!awaitFd(vm, fd, false, &failed))
+        return !failed;
+
+    // Read straight into a string and trim it to size, rather than
+    // reading into a buffer and copying
+    ObjString *string = reserveString(READ_CHUNK);
+    ssize_t count = read(fd, string->chars, READ_CHUNK);
+    if (count > 0)
+    {
+        args[-1] = OBJ_VAL(internString(vm, shrinkString(string, (int)count)));
+        return true;
+    }
+
+    int error = errno;
+    freeObject((Obj *)string);
+    if (count == 0)
+    {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    if (error == EAGAIN || error == EWOULDBLOCK)
+        return awaitAgain(vm, fd, false);
+
+    runtimeError(vm, "Cannot read descriptor %d: %s.", fd, strerror(error));
+    return false;
+}
+
+// write(fd, string): wait for room, returns the bytes written
+static bool writeNative(VM *vm, int argCount, Value *args)
+{
+    int fd;
+    bool failed;
+    if (!toFd(vm, args[0], &fd))
+        return false;
+    if (!IS_STRING(args[1]))
+    {
+        runtimeError(vm, "write() expects a string.");
+        return false;
+    }
+    if (!awaitFd(vm, fd, true, &failed))
+        return !failed;
+
+    ObjString *string = AS_STRING(args[1]);
+    ssize_t count = write(fd, string->chars, string->length);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return awaitAgain(vm, fd, true);
+    if (count < 0)
+    {
+        runtimeError(vm, "Cannot write descriptor %d: %s.", fd, strerror(errno));
+        return false;
+    }
+
+    args[-1] = NUMBER_VAL((double)count);
+    return true;
+}
+
+static bool closeNative(VM *vm, int argCount, Value *args)
+{
+    int fd;
+    if (!toFd(vm, args[0], &fd))
+        return false;
+
+    forgetFd(&vm->loop, fd);
+    close(fd);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static void defineNative(VM *vm, const char *name, int arity, NativeFn function)
+{
+    ObjString *key = copyString(vm, name, (int)strlen(name));
+    tableSet(&vm->globals, key, OBJ_VAL(newNative(vm, name, arity, function)));
+}
+
+void defineNatives(VM *vm)
+{
+    defineNative(vm, "spawn", 1, spawnNative);
+    defineNative(vm, "send", 2, sendNative);
+    defineNative(vm, "receive", 1, receiveNative);
+
+    defineNative(vm, "fiber", 1, fiberNative);
+    defineNative(vm, "yield", 0, yieldNative);
+    defineNative(vm, "sleep", 1, sleepNative);
+    defineNative(vm, "pipe", 0, pipeNative);
+    defineNative(vm, "pipeWriter", 1, pipeWriterNative);
+    defineNative(vm, "open", 1, openNative);
+    defineNative(vm, "read", 1, readNative);
+    defineNative(vm, "write", 2, writeNative);
+    defineNative(vm, "close", 1, closeNative);
+}
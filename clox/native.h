@@ -0,0 +1,9 @@
+#ifndef clox_native_h
+#define clox_native_h
+
+#include "common.h"
+
+// Bind the built-in functions as globals of `vm`
+void defineNatives(VM *vm);
+
+#endif
@@ -0,0 +1,461 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+/*
+Three ways to the double closest to w * 10^q, fastest first:
+
+1. When w and 10^|q| are both exact doubles, one IEEE multiplication
+   or division rounds correctly by itself (Clinger's fast path).
+2. Otherwise w is multiplied by a 128-bit approximation of 10^q, which
+   pins down the result unless it lies too close to halfway between
+   two doubles to tell (Eisel and Lemire's algorithm, as in
+   fast_float).
+3. strtod() on the text sorts out whatever is left.
+*/
+
+#define POW10_MIN -64
+#define POW10_MAX 64
+
+// The 128 most significant bits of 10^q, normalized so the top bit is
+// set. Truncated for q >= 0, rounded up for q < 0. Only the powers a
+// literal of up to 64 digits can need, anything further goes to strtod.
+static const uint64_t pow10Bits[POW10_MAX - POW10_MIN + 1][2] = {
+    {0xa87fea27a539e9a5ull, 0x3f2398d747b36224ull}, // 10^-64
+    {0xd29fe4b18e88640eull, 0x8eec7f0d19a03aadull}, // 10^-63
+    {0x83a3eeeef9153e89ull, 0x1953cf68300424acull}, // 10^-62
+    {0xa48ceaaab75a8e2bull, 0x5fa8c3423c052dd7ull}, // 10^-61
+    {0xcdb02555653131b6ull, 0x3792f412cb06794dull}, // 10^-60
+    {0x808e17555f3ebf11ull, 0xe2bbd88bbee40bd0ull}, // 10^-59
+    {0xa0b19d2ab70e6ed6ull, 0x5b6aceaeae9d0ec4ull}, // 10^-58
+    {0xc8de047564d20a8bull, 0xf245825a5a445275ull}, // 10^-57
+    {0xfb158592be068d2eull, 0xeed6e2f0f0d56712ull}, // 10^-56
+    {0x9ced737bb6c4183dull, 0x55464dd69685606bull}, // 10^-55
+    {0xc428d05aa4751e4cull, 0xaa97e14c3c26b886ull}, // 10^-54
+    {0xf53304714d9265dfull, 0xd53dd99f4b3066a8ull}, // 10^-53
+    {0x993fe2c6d07b7fabull, 0xe546a8038efe4029ull}, // 10^-52
+    {0xbf8fdb78849a5f96ull, 0xde98520472bdd033ull}, // 10^-51
+    {0xef73d256a5c0f77cull, 0x963e66858f6d4440ull}, // 10^-50
+    {0x95a8637627989aadull, 0xdde7001379a44aa8ull}, // 10^-49
+    {0xbb127c53b17ec159ull, 0x5560c018580d5d52ull}, // 10^-48
+    {0xe9d71b689dde71afull, 0xaab8f01e6e10b4a6ull}, // 10^-47
+    {0x9226712162ab070dull, 0xcab3961304ca70e8ull}, // 10^-46
+    {0xb6b00d69bb55c8d1ull, 0x3d607b97c5fd0d22ull}, // 10^-45
+    {0xe45c10c42a2b3b05ull, 0x8cb89a7db77c506aull}, // 10^-44
+    {0x8eb98a7a9a5b04e3ull, 0x77f3608e92adb242ull}, // 10^-43
+    {0xb267ed1940f1c61cull, 0x55f038b237591ed3ull}, // 10^-42
+    {0xdf01e85f912e37a3ull, 0x6b6c46dec52f6688ull}, // 10^-41
+    {0x8b61313bbabce2c6ull, 0x2323ac4b3b3da015ull}, // 10^-40
+    {0xae397d8aa96c1b77ull, 0xabec975e0a0d081aull}, // 10^-39
+    {0xd9c7dced53c72255ull, 0x96e7bd358c904a21ull}, // 10^-38
+    {0x881cea14545c7575ull, 0x7e50d64177da2e54ull}, // 10^-37
+    {0xaa242499697392d2ull, 0xdde50bd1d5d0b9e9ull}, // 10^-36
+    {0xd4ad2dbfc3d07787ull, 0x955e4ec64b44e864ull}, // 10^-35
+    {0x84ec3c97da624ab4ull, 0xbd5af13bef0b113eull}, // 10^-34
+    {0xa6274bbdd0fadd61ull, 0xecb1ad8aeacdd58eull}, // 10^-33
+    {0xcfb11ead453994baull, 0x67de18eda5814af2ull}, // 10^-32
+    {0x81ceb32c4b43fcf4ull, 0x80eacf948770ced7ull}, // 10^-31
+    {0xa2425ff75e14fc31ull, 0xa1258379a94d028dull}, // 10^-30
+    {0xcad2f7f5359a3b3eull, 0x096ee45813a04330ull}, // 10^-29
+    {0xfd87b5f28300ca0dull, 0x8bca9d6e188853fcull}, // 10^-28
+    {0x9e74d1b791e07e48ull, 0x775ea264cf55347eull}, // 10^-27
+    {0xc612062576589ddaull, 0x95364afe032a819eull}, // 10^-26
+    {0xf79687aed3eec551ull, 0x3a83ddbd83f52205ull}, // 10^-25
+    {0x9abe14cd44753b52ull, 0xc4926a9672793543ull}, // 10^-24
+    {0xc16d9a0095928a27ull, 0x75b7053c0f178294ull}, // 10^-23
+    {0xf1c90080baf72cb1ull, 0x5324c68b12dd6339ull}, // 10^-22
+    {0x971da05074da7beeull, 0xd3f6fc16ebca5e04ull}, // 10^-21
+    {0xbce5086492111aeaull, 0x88f4bb1ca6bcf585ull}, // 10^-20
+    {0xec1e4a7db69561a5ull, 0x2b31e9e3d06c32e6ull}, // 10^-19
+    {0x9392ee8e921d5d07ull, 0x3aff322e62439fd0ull}, // 10^-18
+    {0xb877aa3236a4b449ull, 0x09befeb9fad487c3ull}, // 10^-17
+    {0xe69594bec44de15bull, 0x4c2ebe687989a9b4ull}, // 10^-16
+    {0x901d7cf73ab0acd9ull, 0x0f9d37014bf60a11ull}, // 10^-15
+    {0xb424dc35095cd80full, 0x538484c19ef38c95ull}, // 10^-14
+    {0xe12e13424bb40e13ull, 0x2865a5f206b06fbaull}, // 10^-13
+    {0x8cbccc096f5088cbull, 0xf93f87b7442e45d4ull}, // 10^-12
+    {0xafebff0bcb24aafeull, 0xf78f69a51539d749ull}, // 10^-11
+    {0xdbe6fecebdedd5beull, 0xb573440e5a884d1cull}, // 10^-10
+    {0x89705f4136b4a597ull, 0x31680a88f8953031ull}, // 10^-9
+    {0xabcc77118461cefcull, 0xfdc20d2b36ba7c3eull}, // 10^-8
+    {0xd6bf94d5e57a42bcull, 0x3d32907604691b4dull}, // 10^-7
+    {0x8637bd05af6c69b5ull, 0xa63f9a49c2c1b110ull}, // 10^-6
+    {0xa7c5ac471b478423ull, 0x0fcf80dc33721d54ull}, // 10^-5
+    {0xd1b71758e219652bull, 0xd3c36113404ea4a9ull}, // 10^-4
+    {0x83126e978d4fdf3bull, 0x645a1cac083126eaull}, // 10^-3
+    {0xa3d70a3d70a3d70aull, 0x3d70a3d70a3d70a4ull}, // 10^-2
+    {0xccccccccccccccccull, 0xcccccccccccccccdull}, // 10^-1
+    {0x8000000000000000ull, 0x0000000000000000ull}, // 10^0
+    {0xa000000000000000ull, 0x0000000000000000ull}, // 10^1
+    {0xc800000000000000ull, 0x0000000000000000ull}, // 10^2
+    {0xfa00000000000000ull, 0x0000000000000000ull}, // 10^3
+    {0x9c40000000000000ull, 0x0000000000000000ull}, // 10^4
+    {0xc350000000000000ull, 0x0000000000000000ull}, // 10^5
+    {0xf424000000000000ull, 0x0000000000000000ull}, // 10^6
+    {0x9896800000000000ull, 0x0000000000000000ull}, // 10^7
+    {0xbebc200000000000ull, 0x0000000000000000ull}, // 10^8
+    {0xee6b280000000000ull, 0x0000000000000000ull}, // 10^9
+    {0x9502f90000000000ull, 0x0000000000000000ull}, // 10^10
+    {0xba43b74000000000ull, 0x0000000000000000ull}, // 10^11
+    {0xe8d4a51000000000ull, 0x0000000000000000ull}, // 10^12
+    {0x9184e72a00000000ull, 0x0000000000000000ull}, // 10^13
+    {0xb5e620f480000000ull, 0x0000000000000000ull}, // 10^14
+    {0xe35fa931a0000000ull, 0x0000000000000000ull}, // 10^15
+    {0x8e1bc9bf04000000ull, 0x0000000000000000ull}, // 10^16
+    {0xb1a2bc2ec5000000ull, 0x0000000000000000ull}, // 10^17
+    {0xde0b6b3a76400000ull, 0x0000000000000000ull}, // 10^18
+    {0x8ac7230489e80000ull, 0x0000000000000000ull}, // 10^19
+    {0xad78ebc5ac620000ull, 0x0000000000000000ull}, // 10^20
+    {0xd8d726b7177a8000ull, 0x0000000000000000ull}, // 10^21
+    {0x878678326eac9000ull, 0x0000000000000000ull}, // 10^22
+    {0xa968163f0a57b400ull, 0x0000000000000000ull}, // 10^23
+    {0xd3c21bcecceda100ull, 0x0000000000000000ull}, // 10^24
+    {0x84595161401484a0ull, 0x0000000000000000ull}, // 10^25
+    {0xa56fa5b99019a5c8ull, 0x0000000000000000ull}, // 10^26
+    {0xcecb8f27f4200f3aull, 0x0000000000000000ull}, // 10^27
+    {0x813f3978f8940984ull, 0x4000000000000000ull}, // 10^28
+    {0xa18f07d736b90be5ull, 0x5000000000000000ull}, // 10^29
+    {0xc9f2c9cd04674edeull, 0xa400000000000000ull}, // 10^30
+    {0xfc6f7c4045812296ull, 0x4d00000000000000ull}, // 10^31
+    {0x9dc5ada82b70b59dull, 0xf020000000000000ull}, // 10^32
+    {0xc5371912364ce305ull, 0x6c28000000000000ull}, // 10^33
+    {0xf684df56c3e01bc6ull, 0xc732000000000000ull}, // 10^34
+    {0x9a130b963a6c115cull, 0x3c7f400000000000ull}, // 10^35
+    {0xc097ce7bc90715b3ull, 0x4b9f100000000000ull}, // 10^36
+    {0xf0bdc21abb48db20ull, 0x1e86d40000000000ull}, // 10^37
+    {0x96769950b50d88f4ull, 0x1314448000000000ull}, // 10^38
+    {0xbc143fa4e250eb31ull, 0x17d955a000000000ull}, // 10^39
+    {0xeb194f8e1ae525fdull, 0x5dcfab0800000000ull}, // 10^40
+    {0x92efd1b8d0cf37beull, 0x5aa1cae500000000ull}, // 10^41
+    {0xb7abc627050305adull, 0xf14a3d9e40000000ull}, // 10^42
+    {0xe596b7b0c643c719ull, 0x6d9ccd05d0000000ull}, // 10^43
+    {0x8f7e32ce7bea5c6full, 0xe4820023a2000000ull}, // 10^44
+    {0xb35dbf821ae4f38bull, 0xdda2802c8a800000ull}, // 10^45
+    {0xe0352f62a19e306eull, 0xd50b2037ad200000ull}, // 10^46
+    {0x8c213d9da502de45ull, 0x4526f422cc340000ull}, // 10^47
+    {0xaf298d050e4395d6ull, 0x9670b12b7f410000ull}, // 10^48
+    {0xdaf3f04651d47b4cull, 0x3c0cdd765f114000ull}, // 10^49
+    {0x88d8762bf324cd0full, 0xa5880a69fb6ac800ull}, // 10^50
+    {0xab0e93b6efee0053ull, 0x8eea0d047a457a00ull}, // 10^51
+    {0xd5d238a4abe98068ull, 0x72a4904598d6d880ull}, // 10^52
+    {0x85a36366eb71f041ull, 0x47a6da2b7f864750ull}, // 10^53
+    {0xa70c3c40a64e6c51ull, 0x999090b65f67d924ull}, // 10^54
+    {0xd0cf4b50cfe20765ull, 0xfff4b4e3f741cf6dull}, // 10^55
+    {0x82818f1281ed449full, 0xbff8f10e7a8921a4ull}, // 10^56
+    {0xa321f2d7226895c7ull, 0xaff72d52192b6a0dull}, // 10^57
+    {0xcbea6f8ceb02bb39ull, 0x9bf4f8a69f764490ull}, // 10^58
+    {0xfee50b7025c36a08ull, 0x02f236d04753d5b4ull}, // 10^59
+    {0x9f4f2726179a2245ull, 0x01d762422c946590ull}, // 10^60
+    {0xc722f0ef9d80aad6ull, 0x424d3ad2b7b97ef5ull}, // 10^61
+    {0xf8ebad2b84e0d58bull, 0xd2e0898765a7deb2ull}, // 10^62
+    {0x9b934c3b330c8577ull, 0x63cc55f49f88eb2full}, // 10^63
+    {0xc2781f49ffcfa6d5ull, 0x3cbf6b71c76b25fbull}, // 10^64
+};
+
+// The exactly representable powers of ten
+static const double exactPowers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool clinger(uint64_t w, int q, double *value)
+{
+    // x87 math keeps extra precision and would round twice
+#if FLT_EVAL_METHOD == 0
+    if (w <= (1ull << 53) && q >= -22 && q <= 22)
+    {
+        *value = q < 0 ? (double)w / exactPowers[-q] : (double)w * exactPowers[q];
+        return true;
+    }
+#endif
+    return false;
+}
+
+// The full 128-bit product of two 64-bit numbers
+static inline void multiply(uint64_t a, uint64_t b, uint64_t *high, uint64_t *low)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#else
+    uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+    uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+    uint64_t lowLow = aLow * bLow;
+    uint64_t highLow = aHigh * bLow;
+    uint64_t lowHigh = aLow * bHigh;
+    uint64_t middle = (lowLow >> 32) + (uint32_t)highLow + (uint32_t)lowHigh;
+    *high = aHigh * bHigh + (highLow >> 32) + (lowHigh >> 32) + (middle >> 32);
+    *low = (middle << 32) | (uint32_t)lowLow;
+#endif
+}
+
+static bool eiselLemire(uint64_t w, int q, double *value)
+{
+    if (w == 0)
+    {
+        *value = 0;
+        return true;
+    }
+    if (q < POW10_MIN || q > POW10_MAX)
+        return false;
+
+    const uint64_t *power = pow10Bits[q - POW10_MIN];
+
+    // floor(log2(10^q)), from 217706 / 2^16 ~ log2(10)
+    int64_t exponent = (((int64_t)217706 * q) >> 16) + 1024 + 63;
+    int zeros = __builtin_clzll(w);
+    w <<= zeros;
+
+    uint64_t upper, lower;
+    multiply(w, power[0], &upper, &lower);
+
+    // The low bits of the product may be off by the part of 10^q
+    // that was cut. Bring in the next 64 bits when that matters.
+    if ((upper & 0x1ff) == 0x1ff && lower + w < lower)
+    {
+        uint64_t middle, bottom;
+        multiply(w, power[1], &middle, &bottom);
+        uint64_t sum = lower + middle;
+        if (sum < lower)
+            upper++;
+        if (sum + 1 == 0 && (upper & 0x1ff) == 0x1ff && bottom + w < bottom)
+            return false;
+        lower = sum;
+    }
+
+    // 54 bits: the mantissa and one more for rounding
+    uint64_t upperBit = upper >> 63;
+    uint64_t mantissa = upper >> (upperBit + 9);
+    zeros += 1 ^ (int)upperBit;
+
+    // Exactly halfway between two doubles, as far as we can see
+    if (lower == 0 && (upper & 0x1ff) == 0 && (mantissa & 3) == 1)
+        return false;
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (1ull << 53))
+    {
+        // Rounding carried into a new bit
+        mantissa = 1ull << 52;
+        zeros--;
+    }
+    mantissa &= ~(1ull << 52);
+
+    int64_t biased = exponent - zeros;
+    if (biased < 1 || biased > 2046)
+        return false;
+
+    uint64_t bits = mantissa | ((uint64_t)biased << 52);
+    memcpy(value, &bits, sizeof(bits));
+    return true;
+}
+
+double decimalToDouble(uint64_t mantissa, int exponent, bool truncated, const char *text)
+{
+    double value;
+    if (!truncated)
+    {
+        if (clinger(mantissa, exponent, &value) || eiselLemire(mantissa, exponent, &value))
+            return value;
+    }
+    else
+    {
+        // The literal lies somewhere between the digits we kept and
+        // those plus one. If both round the same way, so does it.
+        double above;
+        if (eiselLemire(mantissa, exponent, &value) && eiselLemire(mantissa + 1, exponent, &above) &&
+            value == above)
+            return value;
+    }
+    return strtod(text, NULL);
+}
+
+/*
+Formatting follows "%g": six significant digits, correctly rounded
+(halfway cases to even), fixed notation for exponents from -4 to 5 and
+scientific notation otherwise, with trailing zeros dropped.
+
+The six digits are exact for whole numbers below 2^53, which are done
+in integer arithmetic. Anything else is scaled by an exact power of
+ten, which rounds once, so the result is only off by a tiny fraction
+of the last digit. Unless that fraction comes close enough to one half
+to matter, the rounding goes the same way as it would on the exact
+value. snprintf() takes the rest.
+*/
+#define PRECISION 6
+#define PRECISION_MIN 100000  // 10^(PRECISION - 1)
+#define PRECISION_END 1000000 // 10^PRECISION
+
+// Round the whole number `n` to six significant digits
+static void roundWhole(uint64_t n, uint32_t *digits, int *exponent)
+{
+    int e = PRECISION - 1;
+    uint64_t divisor = 1;
+    while (n / divisor >= PRECISION_END)
+    {
+        divisor *= 10;
+        e++;
+    }
+
+    uint64_t kept = n / divisor;
+    uint64_t rest = n % divisor;
+    uint64_t half = divisor / 2;
+    if (rest > half || (rest == half && divisor > 1 && (kept & 1)))
+        kept++;
+    if (kept == PRECISION_END)
+    {
+        kept = PRECISION_MIN;
+        e++;
+    }
+    *digits = (uint32_t)kept;
+    *exponent = e;
+}
+
+// value * 10^power with a single rounding, when that's possible
+static bool scale(double value, int power, double *scaled)
+{
+    if (power < -22 || power > 22)
+        return false;
+    *scaled = power < 0 ? value / exactPowers[-power] : value * exactPowers[power];
+    return true;
+}
+
+static bool roundFraction(double value, uint32_t *digits, int *exponent)
+{
+    // A first guess at the decimal exponent from the binary one,
+    // 78913 / 2^18 ~ log10(2). It can be one too low.
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int binary = (int)((bits >> 52) & 0x7ff) - 1023;
+    int e = (binary * 78913) >> 18;
+
+    double scaled;
+    if (!scale(value, PRECISION - 1 - e, &scaled))
+        return false;
+    if (scaled >= PRECISION_END)
+    {
+        e++;
+        if (!scale(value, PRECISION - 1 - e, &scaled))
+            return false;
+    }
+    if (scaled < PRECISION_MIN - 0.5 || scaled >= PRECISION_END)
+        return false;
+
+    // `scaled` is within half an ulp (~1e-10) of the exact product
+    uint32_t kept = (uint32_t)scaled;
+    double fraction = scaled - kept;
+    if (fraction > 0.5 - 1e-9 && fraction < 0.5 + 1e-9)
+        return false;
+    if (fraction > 0.5)
+        kept++;
+    if (kept == PRECISION_END)
+    {
+        kept = PRECISION_MIN;
+        e++;
+    }
+    *digits = kept;
+    *exponent = e;
+    return true;
+}
+
+static char *writeDigits(char *out, const char *digits, int count)
+{
+    memcpy(out, digits, count);
+    return out + count;
+}
+
+int formatNumber(double value, char *buffer)
+{
+    if (!isfinite(value))
+        return snprintf(buffer, NUMBER_MAX, "%g", value);
+
+    char *out = buffer;
+    double magnitude = value;
+    if (signbit(value))
+    {
+        *out++ = '-';
+        magnitude = -value;
+    }
+
+    // Small whole numbers, by far the most common, as they are
+    if (magnitude < PRECISION_END && magnitude == (double)(uint32_t)magnitude)
+    {
+        char digits[PRECISION];
+        int count = 0;
+        uint32_t n = (uint32_t)magnitude;
+        do
+        {
+            digits[PRECISION - 1 - count++] = (char)('0' + n % 10);
+            n /= 10;
+        } while (n != 0);
+        out = writeDigits(out, digits + PRECISION - count, count);
+        *out = '\0';
+        return (int)(out - buffer);
+    }
+
+    uint32_t n;
+    int exponent;
+    if (magnitude < 9007199254740992.0 && magnitude == (double)(uint64_t)magnitude)
+        roundWhole((uint64_t)magnitude, &n, &exponent);
+    else if (!roundFraction(magnitude, &n, &exponent))
+        return snprintf(buffer, NUMBER_MAX, "%g", value);
+
+    char digits[PRECISION];
+    for (int i = PRECISION - 1; i >= 0; i--)
+    {
+        digits[i] = (char)('0' + n % 10);
+        n /= 10;
+    }
+    int count = PRECISION;
+    while (count > 1 && digits[count - 1] == '0')
+        count--;
+
+    if (exponent >= -4 && exponent < PRECISION)
+    {
+        if (exponent < 0)
+        {
+            *out++ = '0';
+            *out++ = '.';
+            for (int i = -1; i > exponent; i--)
+                *out++ = '0';
+            out = writeDigits(out, digits, count);
+        }
+        else if (count <= exponent + 1)
+        {
+            out = writeDigits(out, digits, count);
+            for (int i = count; i <= exponent; i++)
+                *out++ = '0';
+        }
+        else
+        {
+            out = writeDigits(out, digits, exponent + 1);
+            *out++ = '.';
+            out = writeDigits(out, digits + exponent + 1, count - exponent - 1);
+        }
+    }
+    else
+    {
+        *out++ = digits[0];
+        if (count > 1)
+        {
+            *out++ = '.';
+            out = writeDigits(out, digits + 1, count - 1);
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        int magnitude = exponent < 0 ? -exponent : exponent;
+        if (magnitude >= 100)
+            *out++ = (char)('0' + magnitude / 100);
+        *out++ = (char)('0' + magnitude / 10 % 10);
+        *out++ = (char)('0' + magnitude % 10);
+    }
+
+    *out = '\0';
+    return (int)(out - buffer);
+}
@@ -0,0 +1,26 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+/*
+Turning number literals into doubles. The scanner collects the digits
+while it walks over them, and this finds the closest double without
+going back to the text, except in the rare cases where that takes more
+than 128 bits of precision.
+
+Lox literals have no exponent, so a literal is `mantissa * 10^exponent`
+where the mantissa holds the first MANTISSA_DIGITS significant digits.
+*/
+#define MANTISSA_DIGITS 19 // Fits in a uint64_t
+
+// `truncated` says that non-zero digits were left out of the
+// mantissa, `text` is the literal for when it's needed after all.
+double decimalToDouble(uint64_t mantissa, int exponent, bool truncated, const char *text);
+
+// The other way round: `value` written exactly like printf's "%g"
+// would, which is how Lox prints numbers. Returns the length.
+#define NUMBER_MAX 32 // Room needed in `buffer`, NUL included
+int formatNumber(double value, char *buffer);
+
+#endif
@@ -1,88 +1,274 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "hash.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objType) \
-    (type *)allocateObj(sizeof(type), objType)
+    (type *)allocateObj(vm, sizeof(type), objType)
 
-static Obj *allocateObj(size_t size, ObjType objType)
+static Obj *allocateObj(VM *vm, size_t size, ObjType objType)
 {
     Obj *obj = (Obj *)reallocate(NULL, 0, size);
     obj->type = objType;
 
     // Track all the objects allocated
-    obj->next = vm.objects;
-    vm.objects = obj;
+    obj->next = vm->objects;
+    vm->objects = obj;
     return obj;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+// Takes over one reference to `channel`
+ObjChannel *newChannel(VM *vm, Channel *channel, int side)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjChannel *endpoint = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    endpoint->channel = channel;
+    endpoint->side = side;
+    return endpoint;
+}
 
-    string->chars = chars;
-    string->length = length;
-    string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
-    // Whenever we allocate a new string, we intern it.
+ObjNative *newNative(VM *vm, const char *name, int arity, NativeFn function)
+{
+    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->name = name;
+    native->arity = arity;
+    native->function = function;
+    return native;
+}
 
-    return string;
+// Takes over the characters until the VM is freed
+Value externalString(VM *vm, const char *chars, int length, ReleaseFn release, void *owner)
+{
+    if (length <= SHORT_STRING_MAX)
+    {
+        Value value = shortString(chars, length);
+        if (release != NULL)
+            release(owner, chars, length);
+        return value;
+    }
+
+    ObjExternal *external = ALLOCATE_OBJ(ObjExternal, OBJ_EXTERNAL);
+    external->length = length;
+    external->chars = chars;
+    external->release = release;
+    external->owner = owner;
+    external->interned = NULL;
+    return OBJ_VAL(external);
+}
+
+ObjRope *newRope(VM *vm, Value left, Value right)
+{
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = textLength(left) + textLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->chars = NULL;
+    return rope;
+}
+
+int textLength(Value text)
+{
+    if (IS_SHORT_STRING(text))
+        return text.length;
+    if (IS_STRING(text))
+        return AS_STRING(text)->length;
+    if (IS_EXTERNAL(text))
+        return AS_EXTERNAL(text)->length;
+    return AS_ROPE(text)->length;
 }
 
-// FNV-1a hash function
-static uint32_t hashString(const char *key, int length)
+// Characters of a flat piece, NULL for a rope not flattened yet.
+// Takes a pointer because a short string's characters are inside it.
+static const char *flatChars(Value *text)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
+    if (IS_SHORT_STRING(*text))
+        return text->as.chars;
+    if (IS_STRING(*text))
+        return AS_STRING(*text)->chars;
+    if (IS_EXTERNAL(*text))
+        return AS_EXTERNAL(*text)->chars;
+    return AS_ROPE(*text)->chars;
+}
+
+const char *ropeChars(ObjRope *rope)
+{
+    if (rope->chars != NULL)
+        return rope->chars;
+
+    char *chars = ALLOCATE(char, rope->length + 1);
+    chars[rope->length] = '\0';
+
+    // Fill the buffer back to front. Right children are taken right
+    // away and left ones wait on `pending`, so the usual rope grown
+    // by `s = s + piece` never needs more than one pending node.
+    Value *pending = NULL;
+    int count = 0;
+    int capacity = 0;
+    int end = rope->length;
+    Value node = OBJ_VAL(rope);
+
+    for (;;)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        const char *flat = flatChars(&node);
+        if (flat == NULL)
+        {
+            if (count == capacity)
+            {
+                int oldCapacity = capacity;
+                capacity = GROW_CAPACITY(oldCapacity);
+                pending = GROW_ARRAY(Value, pending, oldCapacity, capacity);
+            }
+            pending[count++] = AS_ROPE(node)->left;
+            node = AS_ROPE(node)->right;
+            continue;
+        }
+
+        int length = textLength(node);
+        end -= length;
+        memcpy(chars + end, flat, length);
+
+        if (count == 0)
+            break;
+        node = pending[--count];
     }
-    return hash;
+
+    FREE_ARRAY(Value, pending, capacity);
+    rope->chars = chars;
+    return chars;
 }
 
-ObjString *takeString(char *chars, int length)
+// Flattens ropes. The pointer must stay put while the result is used.
+// Not NUL terminated for external strings.
+const char *textChars(Value *text)
 {
-    // Before taking the string, check to see
-    // if there're any interned ones.
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (IS_ROPE(*text))
+        return ropeChars(AS_ROPE(*text));
+    return flatChars(text);
+}
 
+// Content equality for two strings where at least one may be a rope
+bool textsEqual(Value a, Value b)
+{
+    if (IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b))
+        return true;
+    if (textLength(a) != textLength(b))
+        return false;
+    return memcmp(textChars(&a), textChars(&b), textLength(a)) == 0;
+}
+
+// The interned ObjString of any string, for code outside the VM loop
+ObjString *toObjString(VM *vm, Value text)
+{
+    if (IS_STRING(text))
+        return AS_STRING(text);
+    if (IS_EXTERNAL(text))
+    {
+        // Hashed and copied once, on first use
+        ObjExternal *external = AS_EXTERNAL(text);
+        if (external->interned == NULL)
+            external->interned = copyString(vm, external->chars, external->length);
+        return external->interned;
+    }
+    return copyString(vm, textChars(&text), textLength(text));
+}
+
+// A string that is not interned yet, for the caller to fill in and
+// pass to internString(). Saves copying the characters.
+ObjString *reserveString(int length)
+{
+    ObjString *string = (ObjString *)reallocate(NULL, 0, sizeof(ObjString) + length + 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.next = NULL; // Strings belong to no VM, see intern.h
+    string->length = length;
+    string->refs = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Give back the end of a reserved string that came out shorter
+ObjString *shrinkString(ObjString *string, int length)
+{
+    string = (ObjString *)reallocate(string, sizeof(ObjString) + string->length + 1, sizeof(ObjString) + length + 1);
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Keep the reference just taken from the process-wide table.
+// vm->strings holds exactly one per string the VM has seen.
+static ObjString *cacheString(VM *vm, ObjString *string)
+{
+    tableSet(&vm->strings, string, NIL_VAL);
+    return string;
+}
+
+ObjString *internString(VM *vm, ObjString *string)
+{
+    string->hash = hashString(string->chars, string->length);
+    ObjString *interned = tableFindString(&vm->strings, string->chars, string->length, string->hash);
     if (interned != NULL)
     {
-        // Remember we use this API when concatenating
-        // strings back in vm.c without freeing it.
-        FREE_ARRAY(char, chars, length + 1);
+        freeObject((Obj *)string);
         return interned;
     }
+    return cacheString(vm, internReserved(string));
+}
 
-    return allocateString(chars, length, hash);
+// Take in a string that already holds a reference for us, e.g. one
+// that arrived over a channel
+ObjString *adoptString(VM *vm, ObjString *string)
+{
+    Value unused;
+    if (tableGet(&vm->strings, string, &unused))
+    {
+        releaseString(string);
+        return string;
+    }
+    return cacheString(vm, string);
 }
 
-ObjString *copyString(const char *start, int length)
+ObjString *copyString(VM *vm, const char *start, int length)
 {
     // Before copy the string, check if there're
-    // any interned ones.
+    // any interned ones. This VM's own cache first,
+    // it needs no lock.
     uint32_t hash = hashString(start, length);
-    ObjString *interned = tableFindString(&vm.strings, start, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, start, length, hash);
 
     if (interned != NULL)
         return interned;
 
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, start, length);
-    chars[length] = '\0';
-    return allocateString(chars, length, hash);
+    return cacheString(vm, internChars(start, length, hash));
+}
+
+// A Lox string value: short strings are kept inline, the rest interned
+Value stringValue(VM *vm, const char *chars, int length)
+{
+    if (length <= SHORT_STRING_MAX)
+        return shortString(chars, length);
+    return OBJ_VAL(copyString(vm, chars, length));
 }
 
 void printObj(Value value)
 {
     switch (OBJ_TYPE(value))
     {
+    case OBJ_CHANNEL:
+        printf("<channel>");
+        break;
+    case OBJ_EXTERNAL:
+        printf("%.*s", AS_EXTERNAL(value)->length, AS_EXTERNAL(value)->chars);
+        break;
+    case OBJ_NATIVE:
+        printf("<native fn %s>", AS_NATIVE(value)->name);
+        break;
+    case OBJ_ROPE:
+        printf("%s", ropeChars(AS_ROPE(value)));
+        break;
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
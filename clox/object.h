@@ -1,11 +1,16 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include "channel.h"
 #include "common.h"
 #include "value.h"
 
 typedef enum
 {
+    OBJ_CHANNEL,
+    OBJ_EXTERNAL,
+    OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
 } ObjType;
 
@@ -22,14 +27,78 @@ struct Obj
 // we are able to treat it as a generic Obj.
 // And by downcasting this obj to ObjString, we restore
 // it back to ObjString.
+//
+// The characters follow the header in the same allocation.
 struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash; // Cache the hash value
+    int refs;      // Shared by every VM that interned it, see intern.h
+    char chars[];  // Always NUL terminated
 };
 
+/*
+The result of `+` on long strings. Instead of copying both sides
+into a new string every time, we keep a node pointing at them, so
+building a string up piece by piece stays linear. The characters are
+only put together (and cached) once somebody looks at them.
+
+A rope is not interned: it is compared by content, and turned into
+an interned ObjString before it leaves the VM loop (native calls,
+the embedding API).
+*/
+#define ROPE_MIN 64 // Shorter results of `+` are copied and interned
+
+typedef struct
+{
+    Obj obj;
+    int length;
+    Value left; // Any string: short, ObjString or ObjRope
+    Value right;
+    char *chars; // NULL until flattened
+} ObjRope;
+
+/*
+A string whose characters belong to the host: a buffer it already
+holds, a mapped file. Nothing is copied or hashed when it comes in.
+Like a rope it is compared by content, and it is only interned (which
+does copy it) the first time it has to leave the VM loop. Strings of
+up to SHORT_STRING_MAX characters are copied into the Value instead.
+*/
+typedef void (*ReleaseFn)(void *owner, const char *chars, int length);
+
+typedef struct
+{
+    Obj obj;
+    int length;
+    const char *chars;   // Borrowed, not NUL terminated
+    ReleaseFn release;   // Called once the VM lets go, may be NULL
+    void *owner;         // Passed back to `release`
+    ObjString *interned; // NULL until somebody needs an ObjString
+} ObjExternal;
+
+// Natives receive their arguments in place on the VM stack and
+// write their result into `args[-1]`, the slot of the callee.
+// On failure they report a runtimeError() and return false.
+typedef bool (*NativeFn)(VM *vm, int argCount, Value *args);
+
+typedef struct
+{
+    Obj obj;
+    int arity;
+    const char *name;
+    NativeFn function;
+} ObjNative;
+
+// A VM's endpoint of a channel shared with another VM
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+    int side;
+} ObjChannel;
+
 // We define it as a standalone function because
 // if otherwise and that we pass in the first argument
 // as `pop()`, the pop method will be executed twice.
@@ -38,15 +107,48 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// A string in any of its representations
+static inline bool isText(Value value)
+{
+    if (IS_SHORT_STRING(value))
+        return true;
+    if (!IS_OBJ(value))
+        return false;
+    ObjType type = AS_OBJ(value)->type;
+    return type == OBJ_STRING || type == OBJ_ROPE || type == OBJ_EXTERNAL;
+}
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define IS_EXTERNAL(value) isObjType(value, OBJ_EXTERNAL)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_TEXT(value) isText(value)
 
+#define AS_CHANNEL(value) ((ObjChannel *)AS_OBJ(value))
+#define AS_EXTERNAL(value) ((ObjExternal *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
-ObjString *takeString(char *chars, int length);
-ObjString *copyString(const char *start, int length);
+ObjChannel *newChannel(VM *vm, Channel *channel, int side);
+ObjNative *newNative(VM *vm, const char *name, int arity, NativeFn function);
+Value externalString(VM *vm, const char *chars, int length, ReleaseFn release, void *owner);
+ObjRope *newRope(VM *vm, Value left, Value right);
+const char *ropeChars(ObjRope *rope);
+int textLength(Value text);
+const char *textChars(Value *text);
+bool textsEqual(Value a, Value b);
+ObjString *toObjString(VM *vm, Value text);
+Value stringValue(VM *vm, const char *chars, int length);
+ObjString *reserveString(int length);
+ObjString *shrinkString(ObjString *string, int length);
+ObjString *internString(VM *vm, ObjString *string);
+ObjString *adoptString(VM *vm, ObjString *string);
+ObjString *copyString(VM *vm, const char *start, int length);
 void printObj(Value value);
 
 #endif
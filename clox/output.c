@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "output.h"
+
+static void writeStdout(void *context, const char *chars, size_t length)
+{
+    (void)context;
+    fwrite(chars, 1, length, stdout);
+    fflush(stdout);
+}
+
+void initOutput(Output *output)
+{
+    output->chars = NULL;
+    output->count = 0;
+    output->capacity = 0;
+    output->write = writeStdout;
+    output->context = NULL;
+
+    // What stdio would do: line buffered on a terminal only
+    output->policy = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_FULL;
+}
+
+void freeOutput(Output *output)
+{
+    flushOutput(output);
+    FREE_ARRAY(char, output->chars, output->capacity);
+    output->chars = NULL;
+    output->capacity = 0;
+}
+
+void setOutput(Output *output, WriteFn write, void *context, FlushPolicy policy)
+{
+    // What was printed so far belongs to the old sink
+    flushOutput(output);
+    output->write = write == NULL ? writeStdout : write;
+    output->context = context;
+    output->policy = policy;
+}
+
+void flushOutput(Output *output)
+{
+    if (output->count == 0)
+        return;
+    output->write(output->context, output->chars, output->count);
+    output->count = 0;
+}
+
+static void reserve(Output *output, size_t needed)
+{
+    size_t capacity = output->capacity < OUTPUT_BUFFER ? OUTPUT_BUFFER : output->capacity;
+    while (capacity < needed)
+        capacity *= 2;
+    if (capacity != output->capacity)
+    {
+        output->chars = GROW_ARRAY(char, output->chars, output->capacity, capacity);
+        output->capacity = capacity;
+    }
+}
+
+void writeOutput(Output *output, const char *chars, size_t length)
+{
+    if (output->count + length > output->capacity)
+    {
+        if (output->policy != FLUSH_EXIT)
+        {
+            flushOutput(output);
+
+            // No point copying what fills the buffer by itself
+            if (length >= OUTPUT_BUFFER)
+            {
+                output->write(output->context, chars, length);
+                return;
+            }
+        }
+        reserve(output, output->count + length);
+    }
+
+    memcpy(output->chars + output->count, chars, length);
+    output->count += length;
+}
+
+static void writeString(Output *output, const char *chars)
+{
+    writeOutput(output, chars, strlen(chars));
+}
+
+static void writeValue(Output *output, Value value)
+{
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        writeString(output, AS_BOOL(value) ? "true" : "false");
+        return;
+    case VAL_NIL:
+        writeString(output, "nil");
+        return;
+    case VAL_NUMBER:
+    {
+        char buffer[NUMBER_MAX];
+        writeOutput(output, buffer, formatNumber(AS_NUMBER(value), buffer));
+        return;
+    }
+    case VAL_SHORT_STRING:
+        writeOutput(output, value.as.chars, value.length);
+        return;
+    case VAL_OBJ:
+        break;
+    }
+
+    switch (OBJ_TYPE(value))
+    {
+    case OBJ_CHANNEL:
+        writeString(output, "<channel>");
+        break;
+    case OBJ_EXTERNAL:
+        writeOutput(output, AS_EXTERNAL(value)->chars, AS_EXTERNAL(value)->length);
+        break;
+    case OBJ_NATIVE:
+        writeString(output, "<native fn ");
+        writeString(output, AS_NATIVE(value)->name);
+        writeString(output, ">");
+        break;
+    case OBJ_ROPE:
+        writeOutput(output, ropeChars(AS_ROPE(value)), AS_ROPE(value)->length);
+        break;
+    case OBJ_STRING:
+        writeOutput(output, AS_STRING(value)->chars, AS_STRING(value)->length);
+        break;
+    }
+}
+
+void printLine(Output *output, Value value)
+{
+    writeValue(output, value);
+    writeOutput(output, "\n", 1);
+    if (output->policy == FLUSH_LINE)
+        flushOutput(output);
+}
@@ -0,0 +1,45 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stddef.h>
+
+#include "common.h"
+#include "value.h"
+
+/*
+Where `print` goes. Every VM collects its output in a buffer of its
+own and hands it to a sink in one piece, instead of taking the stdio
+lock and going through printf for every value. The sink is stdout by
+default; an embedding host can capture the output in memory instead.
+*/
+typedef void (*WriteFn)(void *context, const char *chars, size_t length);
+
+typedef enum
+{
+    FLUSH_LINE, // After every line, the default on a terminal
+    FLUSH_FULL, // Once OUTPUT_BUFFER bytes pile up, and when the script stops
+    FLUSH_EXIT, // Only on flushOutput() and freeVM(), keeping it all until then
+} FlushPolicy;
+
+#define OUTPUT_BUFFER (64 * 1024)
+
+typedef struct
+{
+    char *chars;
+    size_t count;
+    size_t capacity;
+    FlushPolicy policy;
+    WriteFn write;
+    void *context;
+} Output;
+
+void initOutput(Output *output);
+void freeOutput(Output *output);
+// A NULL `write` goes back to stdout
+void setOutput(Output *output, WriteFn write, void *context, FlushPolicy policy);
+void flushOutput(Output *output);
+void writeOutput(Output *output, const char *chars, size_t length);
+// What `print value;` writes
+void printLine(Output *output, Value value);
+
+#endif
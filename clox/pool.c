@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "vm.h"
+
+/*
+A process-wide pool of worker threads, one per core, started on the
+first spawn. Each worker owns a deque of tasks. A worker pushes the
+tasks it spawns onto the bottom of its own deque and pops from there
+too, so nested spawns stay hot in its cache. An idle worker steals
+from the top of the other deques, which hands out the oldest work.
+
+Every task runs on its own VM, so tasks never share a heap and the
+only thing the pool has to synchronize is the deques themselves.
+
+A task blocked on a channel still occupies its thread. When that
+leaves queued work with nobody to run it, the pool starts a spare
+worker which only steals, much like a runtime handing off a thread
+stuck in a system call. Spares are capped at MAX_SPARES, and a spare
+that runs out of work once nothing is blocked any more exits.
+*/
+
+#define SPARE_WORKER -2
+#define NOT_A_WORKER -1
+
+#define MAX_SPARES 256
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Task *tasks; // Ring buffer, `head` is the top
+    int capacity;
+    int head;
+    int count;
+} Deque;
+
+typedef struct
+{
+    int workerCount; // One deque each, even if its thread failed to start
+    int started;     // Workers whose thread is running
+    Deque *deques;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Signalled when a task is queued
+    pthread_cond_t done; // Broadcast when nothing is pending
+    int queued;          // Tasks sitting in a deque
+    int pending;         // Tasks queued or running
+    int idle;            // Workers waiting for a task
+    int blocked;         // Workers waiting on a channel
+    int spares;          // Spare workers alive
+    int nextDeque;       // Round robin for outside submitters
+} Pool;
+
+static Pool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static bool poolStarted = false; // Set once the pool is usable
+static __thread int currentWorker = NOT_A_WORKER;
+
+static void pushBottom(Deque *deque, Task task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity)
+    {
+        // Unroll the ring while growing it
+        int capacity = GROW_CAPACITY(deque->capacity);
+        Task *tasks = ALLOCATE(Task, capacity);
+        for (int i = 0; i < deque->count; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+
+        FREE_ARRAY(Task, deque->tasks, deque->capacity);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool popBottom(Deque *deque, Task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        deque->count--;
+        *task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool stealTop(Deque *deque, Task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool takeTask(int self, Task *task)
+{
+    if (self >= 0 && popBottom(&pool.deques[self], task))
+        return true;
+
+    int first = self >= 0 ? self + 1 : 0;
+    for (int i = 0; i < pool.workerCount; i++)
+    {
+        int victim = (first + i) % pool.workerCount;
+        if (victim != self && stealTop(&pool.deques[victim], task))
+            return true;
+    }
+    return false;
+}
+
+static void runTask(Task task)
+{
+    VM vm;
+    initVM(&vm);
+
+    // The channel object adopts the reference held by the task
+    ObjString *name = copyString(&vm, "channel", 7);
+    tableSet(&vm.globals, name, OBJ_VAL(newChannel(&vm, task.channel, 1)));
+
+    interpret(&vm, task.source);
+
+    // Let the parent drain what we sent and then see the end
+    closeChannel(task.channel);
+    freeVM(&vm);
+    FREE_ARRAY(char, task.source, strlen(task.source) + 1);
+}
+
+static void *workerMain(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    currentWorker = self;
+
+    if (self == SPARE_WORKER)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.idle--;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (;;)
+    {
+        Task task;
+        if (takeTask(self, &task))
+        {
+            pthread_mutex_lock(&pool.lock);
+            pool.queued--;
+            pthread_mutex_unlock(&pool.lock);
+
+            runTask(task);
+
+            pthread_mutex_lock(&pool.lock);
+            if (--pool.pending == 0)
+                pthread_cond_broadcast(&pool.done);
+            pthread_mutex_unlock(&pool.lock);
+            continue;
+        }
+
+        // Another worker may have grabbed the task we were woken
+        // up for, so go back to sleep until something is queued.
+        pthread_mutex_lock(&pool.lock);
+        pool.idle++;
+        while (pool.queued <= 0)
+        {
+            // The workers a spare stood in for are back
+            if (self == SPARE_WORKER && pool.blocked == 0)
+            {
+                pool.idle--;
+                pool.spares--;
+                pthread_mutex_unlock(&pool.lock);
+                return NULL;
+            }
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        pool.idle--;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+static void startPool()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.workerCount = cores > 0 ? (int)cores : 1;
+    pool.deques = ALLOCATE(Deque, pool.workerCount);
+    pool.threads = ALLOCATE(pthread_t, pool.workerCount);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.queued = 0;
+    pool.pending = 0;
+    pool.idle = 0;
+    pool.blocked = 0;
+    pool.spares = 0;
+    pool.nextDeque = 0;
+
+    for (int i = 0; i < pool.workerCount; i++)
+    {
+        Deque *deque = &pool.deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->tasks = NULL;
+        deque->capacity = 0;
+        deque->head = 0;
+        deque->count = 0;
+    }
+
+    // Workers live as long as the process. The deque of one that
+    // failed to start is still drained by the others stealing from it.
+    pool.started = 0;
+    for (int i = 0; i < pool.workerCount; i++)
+    {
+        if (pthread_create(&pool.threads[i], NULL, workerMain, (void *)(intptr_t)i) != 0)
+            continue;
+        pthread_detach(pool.threads[i]);
+        pool.started++;
+    }
+
+    // waitForTasks() may run on a thread that never went through
+    // pthread_once()
+    __atomic_store_n(&poolStarted, true, __ATOMIC_RELEASE);
+}
+
+// Called with the pool lock held
+static void addSpareIfStarved()
+{
+    if (pool.queued <= 0 || pool.idle > 0 || pool.blocked == 0 || pool.spares >= MAX_SPARES)
+        return;
+
+    // Without a spare the queued work waits for a blocked worker to
+    // come back, which never happens if that worker waits on the work
+    // itself. Past MAX_SPARES, tasks that wait on the tasks they
+    // spawned more than that deep can hang.
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerMain, (void *)(intptr_t)SPARE_WORKER) != 0)
+        return;
+    pthread_detach(thread);
+    pool.spares++;
+    pool.idle++; // Counted as idle until it picks something up
+}
+
+/*
+Returns
+-------
+False if there is no thread to run the task on, in which case the
+caller still owns it.
+*/
+bool submitTask(Task task)
+{
+    pthread_once(&poolOnce, startPool);
+    // Nothing would ever run the task, and waitForTasks() would
+    // wait for it forever
+    if (pool.started == 0)
+        return false;
+
+    pthread_mutex_lock(&pool.lock);
+    int target = currentWorker;
+    if (target < 0)
+        target = pool.nextDeque++ % pool.workerCount;
+    pool.pending++;
+    pthread_mutex_unlock(&pool.lock);
+
+    pushBottom(&pool.deques[target], task);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.queued++;
+    addSpareIfStarved();
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    return true;
+}
+
+// Block until every spawned task, including the ones they spawn,
+// has finished. Must not be called from a task.
+void waitForTasks()
+{
+    // False until the first spawn has started the pool, and then
+    // there is nothing to wait for.
+    if (!__atomic_load_n(&poolStarted, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Bracket anything that may block a task for long, so its worker
+// does not count as available while it waits.
+void enterBlocking()
+{
+    if (currentWorker == NOT_A_WORKER)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.blocked++;
+    addSpareIfStarved();
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void leaveBlocking()
+{
+    if (currentWorker == NOT_A_WORKER)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    // Let the idle spares see they can go
+    if (--pool.blocked == 0 && pool.spares > 0)
+        pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
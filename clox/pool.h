@@ -0,0 +1,20 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "channel.h"
+
+// A spawned script. The pool runs it on a fresh VM whose global
+// `channel` is bound to side 1 of `channel`, and closes the channel
+// when the script finishes.
+typedef struct
+{
+    char *source;     // Owned by the task
+    Channel *channel; // One reference owned by the task
+} Task;
+
+bool submitTask(Task task);
+void waitForTasks();
+void enterBlocking();
+void leaveBlocking();
+
+#endif
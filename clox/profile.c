@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+
+typedef enum
+{
+    CLASS_LITERAL,
+    CLASS_STACK,
+    CLASS_GLOBAL,
+    CLASS_LOCAL,
+    CLASS_COMPARE,
+    CLASS_ARITHMETIC,
+    CLASS_STRING,
+    CLASS_BRANCH,
+    CLASS_CALL,
+    CLASS_OUTPUT,
+    CLASS_COUNT
+} OpClass;
+
+static const char *classNames[CLASS_COUNT] = {
+    [CLASS_LITERAL] = "literal",
+    [CLASS_STACK] = "stack",
+    [CLASS_GLOBAL] = "global",
+    [CLASS_LOCAL] = "local",
+    [CLASS_COMPARE] = "compare",
+    [CLASS_ARITHMETIC] = "arithmetic",
+    [CLASS_STRING] = "string",
+    [CLASS_BRANCH] = "branch",
+    [CLASS_CALL] = "call",
+    [CLASS_OUTPUT] = "output",
+};
+
+static const OpClass opClasses[OP_COUNT] = {
+    [OP_CONSTANT] = CLASS_LITERAL,
+    [OP_NIL] = CLASS_LITERAL,
+    [OP_TRUE] = CLASS_LITERAL,
+    [OP_FALSE] = CLASS_LITERAL,
+    [OP_POP] = CLASS_STACK,
+    [OP_DEFINE_GLOBAL] = CLASS_GLOBAL,
+    [OP_GET_GLOBAL] = CLASS_GLOBAL,
+    [OP_SET_GLOBAL] = CLASS_GLOBAL,
+    [OP_GET_LOCAL] = CLASS_LOCAL,
+    [OP_SET_LOCAL] = CLASS_LOCAL,
+    [OP_EQUAL] = CLASS_COMPARE,
+    [OP_GREATER] = CLASS_COMPARE,
+    [OP_LESS] = CLASS_COMPARE,
+    [OP_ADD] = CLASS_ARITHMETIC,
+    [OP_CONCAT] = CLASS_STRING,
+    [OP_SUBTRACT] = CLASS_ARITHMETIC,
+    [OP_MULTIPLY] = CLASS_ARITHMETIC,
+    [OP_DIVIDE] = CLASS_ARITHMETIC,
+    [OP_NOT] = CLASS_COMPARE,
+    [OP_NEGATE] = CLASS_ARITHMETIC,
+    [OP_PRINT] = CLASS_OUTPUT,
+    [OP_JUMP_IF_FALSE] = CLASS_BRANCH,
+    [OP_JUMP] = CLASS_BRANCH,
+    [OP_LOOP] = CLASS_BRANCH,
+    [OP_CALL] = CLASS_CALL,
+    [OP_RETURN] = CLASS_CALL,
+};
+
+// The cheapest of a few back to back clock reads, which every sample
+// pays on top of the instruction it times
+static uint64_t clockOverhead()
+{
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = profileClock();
+        uint64_t elapsed = profileClock() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+void initProfile(OpProfile *profile)
+{
+    memset(profile, 0, sizeof(OpProfile));
+    profile->countdown = PROFILE_PERIOD;
+    profile->pending = -1;
+    profile->overhead = clockOverhead();
+}
+
+bool profileCounters(OpProfile *profile)
+{
+    if (!hasFastCounters())
+        return false;
+
+    // Same as clockOverhead(), with what a sample reads in between
+    uint64_t before[COUNTER_COUNT], after[COUNTER_COUNT];
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        profile->hwOverhead[i] = UINT64_MAX;
+    for (int round = 0; round < 1000; round++)
+    {
+        readCountersFast(before);
+        profileClock();
+        profileClock();
+        readCountersFast(after);
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            if (after[i] - before[i] < profile->hwOverhead[i])
+                profile->hwOverhead[i] = after[i] - before[i];
+    }
+
+    profile->hw = true;
+    return true;
+}
+
+void countEvents(OpProfile *profile)
+{
+    uint64_t now[COUNTER_COUNT];
+    readCountersFast(now);
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        profile->events[profile->pending][i] += now[i] - profile->hwStart[i];
+}
+
+void freeProfile(OpProfile *profile)
+{
+    finishProfile(profile);
+    FREE_ARRAY(OffsetCount, profile->hot, profile->hotCapacity);
+    initProfile(profile);
+}
+
+void startProfile(OpProfile *profile, Chunk *chunk)
+{
+    finishProfile(profile);
+    profile->chunk = chunk;
+    profile->offsetCount = chunk->count;
+    profile->offsets = ALLOCATE(uint64_t, chunk->count);
+    memset(profile->offsets, 0, sizeof(uint64_t) * chunk->count);
+    profile->pending = -1;
+}
+
+// Keep the offsets that ran, along with their line and opcode,
+// since the chunk they point into is about to go
+void finishProfile(OpProfile *profile)
+{
+    if (profile->chunk == NULL)
+        return;
+
+    Chunk *chunk = profile->chunk;
+    for (int offset = 0; offset < profile->offsetCount; offset++)
+    {
+        if (profile->offsets[offset] == 0)
+            continue;
+
+        if (profile->hotCount == profile->hotCapacity)
+        {
+            int oldCapacity = profile->hotCapacity;
+            profile->hotCapacity = GROW_CAPACITY(oldCapacity);
+            profile->hot = GROW_ARRAY(OffsetCount, profile->hot, oldCapacity, profile->hotCapacity);
+        }
+
+        OffsetCount *hot = &profile->hot[profile->hotCount++];
+        hot->offset = offset;
+        hot->line = chunk->lines[offset];
+        hot->op = chunk->code[offset];
+        hot->count = profile->offsets[offset];
+    }
+
+    FREE_ARRAY(uint64_t, profile->offsets, profile->offsetCount);
+    profile->offsets = NULL;
+    profile->offsetCount = 0;
+    profile->chunk = NULL;
+    profile->pending = -1;
+}
+
+static double cyclesPerOp(OpProfile *profile, int op)
+{
+    if (profile->samples[op] == 0)
+        return 0;
+    double cycles = (double)profile->cycles[op] / profile->samples[op] - profile->overhead;
+    return cycles < 0 ? 0 : cycles;
+}
+
+// Average count of a hardware event per execution of `op`
+static double eventsPerOp(OpProfile *profile, int op, Counter counter)
+{
+    if (profile->samples[op] == 0)
+        return 0;
+    double events = (double)profile->events[op][counter] / profile->samples[op] - profile->hwOverhead[counter];
+    return events < 0 ? 0 : events;
+}
+
+// Total cycles an opcode is estimated to have taken
+static double estimatedCycles(OpProfile *profile, int op)
+{
+    return cyclesPerOp(profile, op) * profile->counts[op];
+}
+
+static int byCount(const void *a, const void *b)
+{
+    uint64_t x = ((const OffsetCount *)a)->count, y = ((const OffsetCount *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int byLine(const void *a, const void *b)
+{
+    return ((const OffsetCount *)a)->line - ((const OffsetCount *)b)->line;
+}
+
+static OffsetCount *copyHot(OpProfile *profile)
+{
+    OffsetCount *copy = malloc(sizeof(OffsetCount) * (profile->hotCount + 1));
+    if (profile->hotCount > 0)
+        memcpy(copy, profile->hot, sizeof(OffsetCount) * profile->hotCount);
+    return copy;
+}
+
+typedef struct
+{
+    int line;
+    uint64_t count;
+    double cycles;
+} LineCount;
+
+// Sum the offsets up per source line, in line order. Returns the
+// number of lines, the array is the caller's to free.
+static int countLines(OpProfile *profile, LineCount **lines)
+{
+    OffsetCount *sorted = copyHot(profile);
+    qsort(sorted, profile->hotCount, sizeof(OffsetCount), byLine);
+
+    *lines = malloc(sizeof(LineCount) * (profile->hotCount + 1));
+    int count = 0;
+    for (int i = 0; i < profile->hotCount; i++)
+    {
+        if (count == 0 || (*lines)[count - 1].line != sorted[i].line)
+            (*lines)[count++] = (LineCount){sorted[i].line, 0, 0};
+        (*lines)[count - 1].count += sorted[i].count;
+        (*lines)[count - 1].cycles += sorted[i].count * cyclesPerOp(profile, sorted[i].op);
+    }
+
+    free(sorted);
+    return count;
+}
+
+static double percent(double part, double total)
+{
+    return total == 0 ? 0 : 100.0 * part / total;
+}
+
+void printProfile(FILE *out, OpProfile *profile)
+{
+    finishProfile(profile);
+
+    uint64_t executions = 0;
+    double cycles = 0;
+    uint64_t classCounts[CLASS_COUNT] = {0};
+    double classCycles[CLASS_COUNT] = {0};
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        executions += profile->counts[op];
+        cycles += estimatedCycles(profile, op);
+        classCounts[opClasses[op]] += profile->counts[op];
+        classCycles[opClasses[op]] += estimatedCycles(profile, op);
+    }
+
+    fprintf(out, "== opcodes (1 in %d timed, %llu cycles of overhead taken off) ==\n", PROFILE_PERIOD,
+            (unsigned long long)profile->overhead);
+    fprintf(out, "%-18s %-11s %14s %6s %10s %16s %6s\n", "opcode", "class", "executions", "%",
+            "cycles/op", "cycles", "%");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        if (profile->counts[op] == 0)
+            continue;
+        fprintf(out, "%-18s %-11s %14llu %6.2f %10.1f %16.0f %6.2f\n", opcodeName(op),
+                classNames[opClasses[op]], (unsigned long long)profile->counts[op],
+                percent(profile->counts[op], executions), cyclesPerOp(profile, op),
+                estimatedCycles(profile, op), percent(estimatedCycles(profile, op), cycles));
+    }
+
+    if (profile->hw)
+    {
+        fprintf(out, "\n== hardware counters per execution ==\n");
+        fprintf(out, "%-18s %12s %12s %8s %14s %14s\n", "opcode", "instructions", "cycles", "IPC",
+                "branch misses", "L1d misses");
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            if (profile->counts[op] == 0)
+                continue;
+            double instructions = eventsPerOp(profile, op, COUNTER_INSTRUCTIONS);
+            double pmcCycles = eventsPerOp(profile, op, COUNTER_CYCLES);
+            fprintf(out, "%-18s %12.1f %12.1f %8.2f %14.3f %14.3f\n", opcodeName(op), instructions,
+                    pmcCycles, pmcCycles == 0 ? 0 : instructions / pmcCycles,
+                    eventsPerOp(profile, op, COUNTER_BRANCH_MISSES), eventsPerOp(profile, op, COUNTER_L1D_MISSES));
+        }
+    }
+
+    fprintf(out, "\n== classes ==\n");
+    fprintf(out, "%-11s %14s %6s %16s %6s\n", "class", "executions", "%", "cycles", "%");
+    for (int c = 0; c < CLASS_COUNT; c++)
+    {
+        if (classCounts[c] == 0)
+            continue;
+        fprintf(out, "%-11s %14llu %6.2f %16.0f %6.2f\n", classNames[c], (unsigned long long)classCounts[c],
+                percent(classCounts[c], executions), classCycles[c], percent(classCycles[c], cycles));
+    }
+
+    fprintf(out, "\n== hot offsets ==\n");
+    fprintf(out, "%6s %6s %-18s %14s %6s\n", "offset", "line", "opcode", "executions", "%");
+    OffsetCount *sorted = copyHot(profile);
+    qsort(sorted, profile->hotCount, sizeof(OffsetCount), byCount);
+    for (int i = 0; i < profile->hotCount && i < PROFILE_HOT; i++)
+        fprintf(out, "%6d %6d %-18s %14llu %6.2f\n", sorted[i].offset, sorted[i].line,
+                opcodeName(sorted[i].op), (unsigned long long)sorted[i].count,
+                percent(sorted[i].count, executions));
+    free(sorted);
+
+    fprintf(out, "\n== lines ==\n");
+    fprintf(out, "%6s %14s %6s %16s %6s\n", "line", "executions", "%", "cycles", "%");
+    LineCount *lines;
+    int lineCount = countLines(profile, &lines);
+    for (int i = 0; i < lineCount; i++)
+        fprintf(out, "%6d %14llu %6.2f %16.0f %6.2f\n", lines[i].line, (unsigned long long)lines[i].count,
+                percent(lines[i].count, executions), lines[i].cycles, percent(lines[i].cycles, cycles));
+    free(lines);
+    if (profile->elsewhere > 0)
+        fprintf(out, "%6s %14llu %6.2f\n", "fibers", (unsigned long long)profile->elsewhere,
+                percent(profile->elsewhere, executions));
+}
+
+void printProfileJson(FILE *out, OpProfile *profile)
+{
+    finishProfile(profile);
+
+    fprintf(out, "{\n  \"period\": %d,\n  \"overhead\": %llu,\n  \"fibers\": %llu,\n  \"opcodes\": [",
+            PROFILE_PERIOD, (unsigned long long)profile->overhead, (unsigned long long)profile->elsewhere);
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        if (profile->counts[op] == 0)
+            continue;
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"class\": \"%s\", \"count\": %llu, \"samples\": %llu, "
+                     "\"sampledCycles\": %llu, \"cycles\": %.0f",
+                first ? "" : ",", opcodeName(op), classNames[opClasses[op]],
+                (unsigned long long)profile->counts[op], (unsigned long long)profile->samples[op],
+                (unsigned long long)profile->cycles[op], estimatedCycles(profile, op));
+        if (profile->hw)
+            fprintf(out, ", \"instructions\": %.1f, \"pmcCycles\": %.1f, \"branchMisses\": %.3f, "
+                         "\"l1dMisses\": %.3f",
+                    eventsPerOp(profile, op, COUNTER_INSTRUCTIONS), eventsPerOp(profile, op, COUNTER_CYCLES),
+                    eventsPerOp(profile, op, COUNTER_BRANCH_MISSES), eventsPerOp(profile, op, COUNTER_L1D_MISSES));
+        fprintf(out, "}");
+        first = false;
+    }
+
+    fprintf(out, "\n  ],\n  \"offsets\": [");
+    for (int i = 0; i < profile->hotCount; i++)
+    {
+        OffsetCount *hot = &profile->hot[i];
+        fprintf(out, "%s\n    {\"offset\": %d, \"line\": %d, \"opcode\": \"%s\", \"count\": %llu}",
+                i == 0 ? "" : ",", hot->offset, hot->line, opcodeName(hot->op),
+                (unsigned long long)hot->count);
+    }
+
+    fprintf(out, "\n  ],\n  \"lines\": [");
+    LineCount *lines;
+    int lineCount = countLines(profile, &lines);
+    for (int i = 0; i < lineCount; i++)
+        fprintf(out, "%s\n    {\"line\": %d, \"count\": %llu, \"cycles\": %.0f}", i == 0 ? "" : ",",
+                lines[i].line, (unsigned long long)lines[i].count, lines[i].cycles);
+    free(lines);
+
+    fprintf(out, "\n  ]\n}\n");
+}
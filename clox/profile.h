@@ -0,0 +1,129 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "counters.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/*
+The opcode profiler, only compiled into run() when PROFILE_OPCODES
+is defined (`make main-profile` builds such a binary next to `main`).
+Unlike --trace it prints nothing while the script runs,
+it just counts:
+
+- executions of each opcode
+- executions of each bytecode offset of the script, which the report
+  maps back to source lines through chunk->lines. Fibers started from
+  a string run chunks of their own, with lines of their own; they are
+  only counted as a whole.
+- cycles spent in every PROFILE_PERIOD-th instruction, read from the
+  time stamp counter, to estimate where the time goes per opcode
+- with --hw-counters, and rdpmc allowed, the hardware counters of
+  counters.h over those same instructions
+
+Timing every instruction would cost more than most instructions
+themselves, so only a sample of them is timed and the totals are
+scaled up by the execution counts.
+*/
+
+#define PROFILE_PERIOD 64 // Time one instruction in this many, a power of two
+#define PROFILE_HOT 20    // Offsets listed in the table report
+
+typedef struct
+{
+    int offset;
+    int line;
+    uint8_t op;
+    uint64_t count;
+} OffsetCount;
+
+typedef struct
+{
+    uint64_t counts[OP_COUNT];
+    uint64_t cycles[OP_COUNT];  // Summed over the timed executions only
+    uint64_t samples[OP_COUNT]; // Timed executions
+    uint32_t countdown;
+    int pending; // Opcode being timed, -1 for none
+    uint64_t start;
+    uint64_t overhead; // What reading the clock twice costs by itself
+
+    bool hw; // Whether to read the hardware counters as well
+    uint64_t hwStart[COUNTER_COUNT];
+    uint64_t hwOverhead[COUNTER_COUNT];
+    uint64_t events[OP_COUNT][COUNTER_COUNT]; // Summed like `cycles`
+
+    Chunk *chunk;      // Script being profiled, NULL between scripts
+    uint64_t *offsets; // Executions per offset of `chunk`
+    int offsetCount;
+    uint64_t elsewhere; // Executions in any other chunk
+
+    OffsetCount *hot; // Offsets executed by the scripts profiled so far
+    int hotCount;
+    int hotCapacity;
+} OpProfile;
+
+void initProfile(OpProfile *profile);
+void freeProfile(OpProfile *profile);
+// Bracket each script, finishProfile() before its chunk is freed
+void startProfile(OpProfile *profile, Chunk *chunk);
+void finishProfile(OpProfile *profile);
+// Time instructions with the hardware counters too, false if they
+// can't be read cheaply enough
+bool profileCounters(OpProfile *profile);
+void countEvents(OpProfile *profile);
+void printProfile(FILE *out, OpProfile *profile);
+void printProfileJson(FILE *out, OpProfile *profile);
+
+static inline uint64_t profileClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // Nanoseconds stand in for cycles elsewhere
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Called by run() before each instruction. A timed instruction ends
+// where the next one starts, so its cycles include this function.
+static inline void profileInstruction(OpProfile *profile, Chunk *chunk, const uint8_t *ip)
+{
+    uint8_t op = *ip;
+    profile->counts[op]++;
+    if (chunk == profile->chunk)
+        profile->offsets[ip - chunk->code]++;
+    else
+        profile->elsewhere++;
+
+    // The counters are read outside of the clock reads, so they
+    // don't take up the cycles measured
+    if (profile->pending >= 0)
+    {
+        profile->cycles[profile->pending] += profileClock() - profile->start;
+        profile->samples[profile->pending]++;
+        if (profile->hw)
+            countEvents(profile);
+        profile->pending = -1;
+    }
+
+    if (--profile->countdown == 0)
+    {
+        profile->countdown = PROFILE_PERIOD;
+        profile->pending = op;
+        if (profile->hw)
+            readCountersFast(profile->hwStart);
+        profile->start = profileClock();
+    }
+}
+
+#endif
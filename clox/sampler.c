@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "memory.h"
+#include "sampler.h"
+#include "vm.h"
+
+// What the handler saw, `line` is 0 when no script was running
+typedef struct
+{
+    int line;
+    bool fiber;
+} Sample;
+
+// Only touched by the handler while the timer runs
+static VM *sampled;
+static pthread_t sampledThread;
+static Sample *samples;
+static int sampleCount;
+static int dropped;
+
+static void onTick(int signal)
+{
+    (void)signal;
+    if (sampled == NULL || !pthread_equal(pthread_self(), sampledThread))
+        return;
+    if (sampleCount == SAMPLE_MAX)
+    {
+        dropped++;
+        return;
+    }
+
+    // run() keeps vm->chunk up to date and publishes the ip of each
+    // instruction before it starts, or NULL once it returns. Right
+    // after a fiber switch the two may not match yet.
+    Sample *sample = &samples[sampleCount++];
+    const uint8_t *ip = sampled->sampleIp;
+    Chunk *chunk = sampled->chunk;
+    if (ip == NULL || chunk == NULL || ip < chunk->code || ip >= chunk->code + chunk->count)
+    {
+        sample->line = 0;
+        sample->fiber = false;
+        return;
+    }
+    sample->line = chunk->lines[ip - chunk->code];
+    sample->fiber = chunk != &sampled->script;
+}
+
+static bool setTimer(long usec)
+{
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = usec;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+bool startSampler(VM *vm)
+{
+    if (samples == NULL)
+        samples = ALLOCATE(Sample, SAMPLE_MAX);
+    sampleCount = 0;
+    dropped = 0;
+    sampledThread = pthread_self();
+    sampled = vm;
+    vm->sampling = true;
+
+    // SA_RESTART keeps the ticks from failing blocking calls
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onTick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0 || !setTimer(1000000 / SAMPLE_HZ))
+    {
+        stopSampler();
+        return false;
+    }
+    return true;
+}
+
+void stopSampler()
+{
+    setTimer(0);
+    signal(SIGPROF, SIG_IGN);
+    if (sampled != NULL)
+        sampled->sampling = false;
+    sampled = NULL;
+}
+
+static int bySample(const void *a, const void *b)
+{
+    const Sample *x = a, *y = b;
+    if (x->fiber != y->fiber)
+        return x->fiber - y->fiber;
+    return x->line - y->line;
+}
+
+bool writeSamples(const char *path, const char *root)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    qsort(samples, sampleCount, sizeof(Sample), bySample);
+    for (int i = 0; i < sampleCount;)
+    {
+        int start = i;
+        while (i < sampleCount && bySample(&samples[i], &samples[start]) == 0)
+            i++;
+
+        if (samples[start].line == 0)
+            fprintf(file, "%s;(not running) %d\n", root, i - start);
+        else
+            fprintf(file, "%s;%sline %d %d\n", root, samples[start].fiber ? "fiber;" : "",
+                    samples[start].line, i - start);
+    }
+
+    if (dropped > 0)
+        fprintf(stderr, "Sample buffer full, %d samples dropped.\n", dropped);
+
+    FREE_ARRAY(Sample, samples, SAMPLE_MAX);
+    samples = NULL;
+    sampleCount = 0;
+    return fclose(file) == 0;
+}
@@ -0,0 +1,35 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include "common.h"
+
+/*
+A sampling profiler for Lox code. A SIGPROF timer interrupts the
+process SAMPLE_HZ times per second of CPU time and the handler notes
+which source line the sampled VM is on. Between two samples the only
+cost is that run() stores its ip where the handler can see it, which
+a VM only does while it is being sampled (see `vm->sampling`).
+
+Signals are process-wide, so only one VM, on one thread, can be
+sampled at a time. Ticks that land on other threads, such as the
+workers running spawned scripts, are ignored.
+
+The samples are written in the collapsed stack format that
+flamegraph.pl and speedscope read, one line per stack:
+
+    script.lox;line 12 415
+
+With no function calls in the language yet, a stack is the script
+followed by the line, or by `fiber;line N` for code run by a fiber
+started from a string, whose lines count from its own first line.
+*/
+
+#define SAMPLE_HZ 997        // Off the round numbers other timers tick at
+#define SAMPLE_MAX (1 << 20) // About 17 minutes of CPU time at SAMPLE_HZ
+
+bool startSampler(VM *vm);
+void stopSampler();
+// `root` names the bottom frame, usually the script's path
+bool writeSamples(const char *path, const char *root);
+
+#endif
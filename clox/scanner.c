@@ -1,28 +1,25 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
+#include "number.h"
 #include "scanner.h"
 
-typedef struct
-{
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char *source)
+void initScanner(Scanner *scanner, const char *source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + strlen(source);
+    scanner->line = 1;
 }
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
 static bool isDigit(char c)
@@ -35,58 +32,58 @@ static bool isAlpha(char c)
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
     /*
     Another way to write it:
 
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
     */
-    return *scanner.current++;
+    return *scanner->current++;
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner *scanner)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return '\0';
-    return *(scanner.current + 1);
+    return *(scanner->current + 1);
 }
 
-static bool match(char expect)
+static bool match(Scanner *scanner, char expect)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return false;
-    if (*scanner.current == expect)
+    if (*scanner->current == expect)
     {
-        advance();
+        advance(scanner);
         return true;
     }
     return false;
 }
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner *scanner, TokenType type)
 {
     Token token;
 
     token.type = type;
-    token.line = scanner.line;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
+    token.line = scanner->line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
 
     return token;
 }
 
-static Token errorToken(const char *message)
+static Token errorToken(Scanner *scanner, const char *message)
 {
     Token token;
 
-    token.line = scanner.line;
+    token.line = scanner->line;
     token.start = message;
     token.length = (int)strlen(message);
     token.type = TOKEN_ERROR;
@@ -94,59 +91,142 @@ static Token errorToken(const char *message)
     return token;
 }
 
+/*
+The loops below used to go one character at a time, checking each one
+for a newline. With SSE2 they look at 16 bytes per step instead: one
+compare finds the character we're after, another the newlines, and a
+popcount of the newlines before the match keeps `line` right. They
+never read past `end`, the last few bytes are done one by one.
+*/
+#define SCAN_WIDTH 16
+
+#ifdef __SSE2__
+// Bit i of the result is set when byte i of the chunk is `c`
+static inline uint32_t matchChar(__m128i chunk, char c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+#endif
+
+// __builtin_popcount() is a library call unless the build targets
+// CPUs with a popcnt instruction, and lines are 16 bits at most
+static inline int countBits(uint32_t bits)
+{
+    bits = bits - ((bits >> 1) & 0x5555);
+    bits = (bits & 0x3333) + ((bits >> 2) & 0x3333);
+    bits = (bits + (bits >> 4)) & 0x0f0f;
+    return (bits + (bits >> 8)) & 0x1f;
+}
+
+// Count the newlines below the lowest set bit of `found`
+static inline int linesBefore(uint32_t lines, uint32_t found)
+{
+    return countBits(lines & ((found & -found) - 1));
+}
+
+// Move on to the next `stop` (or the end), counting lines on the way
+static const char *skipUntil(Scanner *scanner, const char *p, char stop)
+{
+#ifdef __SSE2__
+    while (scanner->end - p >= SCAN_WIDTH)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        uint32_t found = matchChar(chunk, stop);
+        uint32_t lines = matchChar(chunk, '\n');
+        if (found != 0)
+        {
+            scanner->line += linesBefore(lines, found);
+            return p + __builtin_ctz(found);
+        }
+        scanner->line += countBits(lines);
+        p += SCAN_WIDTH;
+    }
+#endif
+
+    for (; p < scanner->end && *p != stop; p++)
+    {
+        if (*p == '\n')
+            scanner->line++;
+    }
+    return p;
+}
+
+static inline bool isBlank(Scanner *scanner, char c)
+{
+    if (c == '\n')
+        scanner->line++;
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Move past spaces, tabs and line breaks
+static const char *skipBlanks(Scanner *scanner, const char *p)
+{
+    // Most runs are a space or two between tokens, which isn't worth
+    // a vector load. Indentation after a line break often is.
+    for (const char *stop = p + 4; p < stop; p++)
+    {
+        if (!isBlank(scanner, *p))
+            return p;
+    }
+
+#ifdef __SSE2__
+    while (scanner->end - p >= SCAN_WIDTH)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        uint32_t lines = matchChar(chunk, '\n');
+        uint32_t blanks = matchChar(chunk, ' ') | matchChar(chunk, '\t') | matchChar(chunk, '\r') | lines;
+        uint32_t other = ~blanks & 0xffff;
+        if (other != 0)
+        {
+            scanner->line += linesBefore(lines, other);
+            return p + __builtin_ctz(other);
+        }
+        scanner->line += countBits(lines);
+        p += SCAN_WIDTH;
+    }
+#endif
+
+    while (isBlank(scanner, *p))
+        p++;
+    return p;
+}
+
 // Handle all useless characters: whitespace,
 // line break, \t, \r, comments.
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
-    char c;
-
     for (;;)
-        switch (c = peek())
+        switch (peek(scanner))
         {
         case ' ':
         case '\t':
         case '\r':
-            advance();
-            break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->current = skipBlanks(scanner, scanner->current);
             break;
         case '/':
-            if (peekNext() == '/')
+            if (peekNext(scanner) == '/')
             {
-                while (!isAtEnd() && peek() != '\n')
-                    advance();
-
-                if (!isAtEnd())
-                {
-                    scanner.line++;
-                    advance();
-                }
+                // The line break is left for the case above
+                scanner->current = skipUntil(scanner, scanner->current, '\n');
             }
-            else if (peekNext() == '*')
+            else if (peekNext(scanner) == '*')
             {
-                char c;
-                advance(); // Skip the initial '*'
-
-                do
+                // Every '*' is a candidate for the closing "*/". An
+                // unterminated comment runs to the end of the source.
+                const char *p = scanner->current + 2;
+                for (;;)
                 {
-                    advance();
-                    c = peek();
-
-                    if (c == '\n')
-                        scanner.line++;
-
-                    if (c == '*')
+                    p = skipUntil(scanner, p, '*');
+                    if (p == scanner->end)
+                        break;
+                    if (*++p == '/')
                     {
-                        advance();
-                        if (peek() == '/')
-                        {
-                            advance();
-                            break;
-                        }
+                        p++;
+                        break;
                     }
-                } while (!isAtEnd());
+                }
+                scanner->current = p;
             }
             else
                 return;
@@ -156,42 +236,70 @@ static void skipWhitespace()
         }
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-    char c;
-    while (!isAtEnd() && (c = peek()) != '"')
-    {
-        if (c == '\n')
-            scanner.line++;
-        advance();
-    }
+    scanner->current = skipUntil(scanner, scanner->current, '"');
 
-    if (peek() != '"')
-        return errorToken("Unterminated string.");
+    if (peek(scanner) != '"')
+        return errorToken(scanner, "Unterminated string.");
 
     // Different from jlox, we need both enclosing quotes
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number()
+/*
+The value is worked out on the way, so the compiler never has to parse
+the literal again. The first MANTISSA_DIGITS significant digits go into
+`mantissa`; past that, integer digits only scale it and fraction digits
+are dropped. `exponent` keeps track of where the decimal point is.
+*/
+static Token number(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance();
+    const char *p = scanner->start;
+    uint64_t mantissa = 0;
+    int digits = 0; // Significant ones in the mantissa
+    int exponent = 0;
+    bool truncated = false;
 
-    if (peek() == '.' && isDigit(peekNext()))
+    for (; isDigit(*p); p++)
     {
-        do
-            advance();
-        while (isDigit(peek()));
+        if (digits < MANTISSA_DIGITS)
+        {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+        {
+            truncated |= *p != '0';
+            exponent++;
+        }
     }
 
-    return makeToken(TOKEN_NUMBER);
+    if (*p == '.' && isDigit(p[1]))
+    {
+        for (p++; isDigit(*p); p++)
+        {
+            if (digits < MANTISSA_DIGITS)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+            else
+                truncated |= *p != '0';
+        }
+    }
+
+    scanner->current = p;
+    Token token = makeToken(scanner, TOKEN_NUMBER);
+    token.number = decimalToDouble(mantissa, exponent, truncated, scanner->start);
+    return token;
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType target)
+static TokenType checkKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType target)
 {
-    if (scanner.current - scanner.start == (start + length) && memcmp(scanner.start + start, rest, length) == 0)
+    if (scanner->current - scanner->start == (start + length) && memcmp(scanner->start + start, rest, length) == 0)
         return target;
 
     return TOKEN_IDENTIFIER;
@@ -199,56 +307,56 @@ static TokenType checkKeyword(int start, int length, const char *rest, TokenType
 
 // Simulate that of trie tree since we don't
 // have a built-in hash table in C.
-static TokenType identifierType()
+static TokenType identifierType(Scanner *scanner)
 {
-    switch (*scanner.start)
+    switch (*scanner->start)
     {
     case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
+        return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'c':
-        return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
     case 'e':
-        return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
+        return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
     case 'n':
-        return checkKeyword(1, 2, "il", TOKEN_NIL);
+        return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
     case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
+        return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
     case 'p':
-        return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+        return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
     case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
     case 'v':
-        return checkKeyword(1, 2, "ar", TOKEN_VAR);
+        return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
 
     case 'f':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (*(scanner.start + 1))
+            switch (*(scanner->start + 1))
             {
             case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
+                return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
             case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
             case 'u':
-                return checkKeyword(2, 1, "n", TOKEN_FUN);
+                return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
             }
         }
         break;
     case 't':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (*(scanner.start + 1))
+            switch (*(scanner->start + 1))
             {
             case 'r':
-                return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
             case 'h':
-                return checkKeyword(2, 2, "is", TOKEN_THIS);
+                return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
             }
         }
         break;
@@ -257,69 +365,69 @@ static TokenType identifierType()
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+        advance(scanner);
 
-    return makeToken(identifierType());
+    return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhitespace();
-    scanner.start = scanner.current;
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (isDigit(c))
-        return number();
+        return number(scanner);
     if (isAlpha(c))
-        return identifier();
+        return identifier(scanner);
 
     switch (c)
     {
     // Single token
     case '(':
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return makeToken(TOKEN_LEFT_BRACE);
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return makeToken(TOKEN_RIGHT_BRACE);
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return makeToken(TOKEN_SEMICOLON);
+        return makeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return makeToken(TOKEN_COMMA);
+        return makeToken(scanner, TOKEN_COMMA);
     case '.':
-        return makeToken(TOKEN_DOT);
+        return makeToken(scanner, TOKEN_DOT);
     case '+':
-        return makeToken(TOKEN_PLUS);
+        return makeToken(scanner, TOKEN_PLUS);
     case '-':
-        return makeToken(TOKEN_MINUS);
+        return makeToken(scanner, TOKEN_MINUS);
     case '*':
-        return makeToken(TOKEN_STAR);
+        return makeToken(scanner, TOKEN_STAR);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, TOKEN_SLASH);
 
     // Double tokens
     case '=':
-        return match('=') ? makeToken(TOKEN_EQUAL_EQUAL) : makeToken(TOKEN_EQUAL);
+        return match(scanner, '=') ? makeToken(scanner, TOKEN_EQUAL_EQUAL) : makeToken(scanner, TOKEN_EQUAL);
     case '!':
-        return match('=') ? makeToken(TOKEN_BANG_EQUAL) : makeToken(TOKEN_BANG);
+        return match(scanner, '=') ? makeToken(scanner, TOKEN_BANG_EQUAL) : makeToken(scanner, TOKEN_BANG);
     case '>':
-        return match('=') ? makeToken(TOKEN_GREATER_EQUAL) : makeToken(TOKEN_GREATER);
+        return match(scanner, '=') ? makeToken(scanner, TOKEN_GREATER_EQUAL) : makeToken(scanner, TOKEN_GREATER);
     case '<':
-        return match('=') ? makeToken(TOKEN_LESS_EQUAL) : makeToken(TOKEN_LESS);
+        return match(scanner, '=') ? makeToken(scanner, TOKEN_LESS_EQUAL) : makeToken(scanner, TOKEN_LESS);
 
     // Literal values
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
-}
\ No newline at end of file
+    return errorToken(scanner, "Unexpected character.");
+}
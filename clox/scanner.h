@@ -60,9 +60,18 @@ typedef struct
     const char *start;
     int length;
     int line;
+    double number; // The value of a TOKEN_NUMBER
 } Token;
 
-void initScanner(const char *source);
-Token scanToken();
+typedef struct
+{
+    const char *start;
+    const char *current;
+    const char *end; // The terminating NUL
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
+Token scanToken(Scanner *scanner);
 
 #endif
\ No newline at end of file
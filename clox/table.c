@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "table.h"
 #include "value.h"
 #include "object.h"
@@ -8,100 +12,212 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Slots are probed in aligned groups of this many
+#define GROUP_SIZE 16
+
+// Control bytes. A full slot holds the low 7 bits of its key's hash,
+// so the top bit alone tells full slots from the other two.
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
 void initTable(Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
+    memset(&table->stats, 0, sizeof(table->stats));
 }
 
 void freeTable(Table *table)
 {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-// Since we grow the hash table when load factor > TABLE_MAX_LOAD,
-// it's guaranteed we won't run into infinite loops.
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+// Bit i of the result is set when control byte i of the group is `byte`
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte)
 {
-    uint32_t idx = key->hash % capacity;
-    Entry *tombstone = NULL;
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (uint32_t)(group[i] == byte) << i;
+    return mask;
+#endif
+}
 
-    for (;;)
+// Same, for the slots that are empty or deleted
+static inline uint32_t matchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static void recordProbe(Table *table, uint32_t groups)
+{
+    TableStats *stats = &table->stats;
+    int bucket = groups == 1 ? 0 : 32 - __builtin_clz(groups - 1);
+    stats->probes[bucket < PROBE_BUCKETS ? bucket : PROBE_BUCKETS - 1]++;
+    if ((int)groups > stats->longestProbe)
+        stats->longestProbe = (int)groups;
+}
+
+static inline uint8_t hashFragment(uint32_t hash)
+{
+    return hash & 0x7f;
+}
+
+// The slot a key would like to sit in, see findFreeSlot()
+static inline uint32_t homeSlot(Table *table, uint32_t hash)
+{
+    return (hash >> 7) & ((uint32_t)table->capacity - 1);
+}
+
+/*
+The group of the home slot is looked at first, and from there we
+move 1, 2, 3... groups ahead. With a power-of-two number of groups
+this visits every group once. A lookup is over at the first group
+that still has an empty slot, because an insert would have stopped
+there. The body may read `step_`, the number of groups left behind.
+*/
+#define FOR_EACH_GROUP(table, hash, group)                                   \
+    for (uint32_t groupMask_ = (uint32_t)(table)->capacity / GROUP_SIZE - 1, \
+                  step_ = 0,                                                 \
+                  group = homeSlot(table, hash) / GROUP_SIZE;                \
+         ; group = (group + ++step_) & groupMask_)
+
+static Entry *probeEntry(Table *table, ObjString *key)
+{
+    uint8_t fragment = hashFragment(key->hash);
+    FOR_EACH_GROUP(table, key->hash, group)
     {
-        Entry *entry = entries + idx;
-        if (entry->key == NULL)
+        uint8_t *control = table->control + group * GROUP_SIZE;
+        for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
         {
-            // Don't return the tombstone the moment we
-            // hit it since the desired value maybe right
-            // after it.
-            if (IS_NIL(entry->value))
-                return tombstone != NULL ? tombstone : entry;
-            else
+            Entry *entry = &table->entries[group * GROUP_SIZE + __builtin_ctz(match)];
+            if (entry->key == key)
             {
-                if (tombstone == NULL)
-                    tombstone = entry;
+                recordProbe(table, step_ + 1);
+                return entry;
             }
         }
-        else if (entry->key == key)
-            return entry;
 
-        idx = (idx + 1) % capacity;
+        if (matchByte(control, CTRL_EMPTY) != 0)
+        {
+            recordProbe(table, step_ + 1);
+            return NULL;
+        }
     }
 }
 
-// The reason why we don't use GROW_ARRAY is that all
-// the hashed slot needs to be redistributed since the
-// capacity changes. If we grow the array in place, we
-// might run into a collision because the position is
-// still hold by the old value.
-static void adjustCapacity(Table *table, int capacity)
+static inline Entry *findEntry(Table *table, ObjString *key)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
+    // Most keys got their home slot, which takes no more than one
+    // compare. Free slots have a NULL key so this can't misfire.
+    Entry *home = &table->entries[homeSlot(table, key->hash)];
+    if (home->key == key)
     {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        table->stats.probes[0]++;
+        return home;
     }
+    return probeEntry(table, key);
+}
 
-    // Recalculating the count, excluding the tombstones
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++)
+// The home slot if it's free, otherwise the first empty or deleted
+// slot on the probe sequence of `hash`. The home slot is part of the
+// first group probed, so lookups will find the key either way.
+static int findFreeSlot(Table *table, uint32_t hash)
+{
+    uint32_t home = homeSlot(table, hash);
+    if (table->control[home] & 0x80)
+        return (int)home;
+
+    FOR_EACH_GROUP(table, hash, group)
     {
-        Entry *src = table->entries + i;
-        if (src->key == NULL)
+        uint32_t match = matchFree(table->control + group * GROUP_SIZE);
+        if (match != 0)
+            return group * GROUP_SIZE + __builtin_ctz(match);
+    }
+}
+
+// Every entry is placed again from scratch, which also clears out
+// the tombstones.
+static void adjustCapacity(Table *table, int capacity)
+{
+    uint8_t *oldControl = table->control;
+    Entry *oldEntries = table->entries;
+    int oldCapacity = table->capacity;
+
+    table->control = ALLOCATE(uint8_t, capacity);
+    table->entries = ALLOCATE(Entry, capacity);
+    if (capacity == oldCapacity)
+        table->stats.rehashes++;
+    else
+        table->stats.resizes++;
+
+    table->capacity = capacity;
+    table->tombstones = 0;
+    memset(table->control, CTRL_EMPTY, capacity);
+    for (int i = 0; i < capacity; i++)
+        table->entries[i].key = NULL;
+
+    for (int i = 0; i < oldCapacity; i++)
+    {
+        if (oldControl[i] & 0x80)
             continue;
 
-        Entry *dst = findEntry(entries, capacity, src->key);
-        dst->key = src->key;
-        dst->value = src->value;
-        table->count++;
+        int slot = findFreeSlot(table, oldEntries[i].key->hash);
+        table->control[slot] = oldControl[i];
+        table->entries[slot] = oldEntries[i];
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(uint8_t, oldControl, oldCapacity);
+    FREE_ARRAY(Entry, oldEntries, oldCapacity);
 }
 
 bool tableSet(Table *table, ObjString *key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (table->count > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        Entry *entry = findEntry(table, key);
+        if (entry != NULL)
+        {
+            entry->value = value;
+            return false;
+        }
     }
 
-    Entry *target = findEntry(table->entries, table->capacity, key);
-    bool isNew = target->key == NULL;
-    // Only increment the count when the bucket
-    // is a real emtpy slot rather than a tombstone.
-    if (isNew && IS_NIL(target->value))
-        table->count++;
+    // Tombstones count against the load since they make probing
+    // longer. When they're most of it, rehashing in place is enough.
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD)
+    {
+        int capacity = table->capacity;
+        if (capacity == 0)
+            capacity = GROUP_SIZE;
+        else if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+            capacity *= 2;
+        adjustCapacity(table, capacity);
+    }
 
-    target->key = key;
-    target->value = value;
-    return isNew;
+    int slot = findFreeSlot(table, key->hash);
+    if (table->control[slot] == CTRL_DELETED)
+        table->tombstones--;
+    table->control[slot] = hashFragment(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value)
@@ -109,8 +225,8 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
-    Entry *target = findEntry(table->entries, table->capacity, key);
-    if (target->key == NULL)
+    Entry *target = findEntry(table, key);
+    if (target == NULL)
         return false;
 
     *value = target->value;
@@ -122,18 +238,25 @@ bool tableDelete(Table *table, ObjString *key)
     if (table->count == 0)
         return false;
 
-    Entry *target = findEntry(table->entries, table->capacity, key);
-    if (target->key == NULL)
+    Entry *target = findEntry(table, key);
+    if (target == NULL)
         return false;
 
+    // If the group still has an empty slot no probe ever went past
+    // it, so the slot can simply be empty again. Otherwise a lookup
+    // may have to keep going through here, leave a tombstone.
+    int slot = (int)(target - table->entries);
+    uint8_t *group = table->control + slot / GROUP_SIZE * GROUP_SIZE;
+    if (matchByte(group, CTRL_EMPTY) != 0)
+        table->control[slot] = CTRL_EMPTY;
+    else
+    {
+        table->control[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
+
     target->key = NULL;
-    target->value = BOOL_VAL(true);
-    // We don't decrement the `table->count` here,
-    // since tombstones are treated full buckets.
-    // Otherwise, the array size may not grow and
-    // we are kept inside an array filled with keys
-    // and tombstones, running into an infinite loop
-    // in `findEntry`.
+    table->count--;
     return true;
 }
 
@@ -141,10 +264,9 @@ void tableAddAll(Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry *src = from->entries + i;
-        if (src->key == NULL)
+        if (from->control[i] & 0x80)
             continue;
-        tableSet(to, src->key, src->value);
+        tableSet(to, from->entries[i].key, from->entries[i].value);
     }
 }
 
@@ -158,22 +280,58 @@ Params
 */
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
 {
-    if (table->capacity == 0)
+    if (table->count == 0)
         return NULL;
 
-    uint32_t idx = hash % table->capacity;
-    for (;;)
+    uint8_t fragment = hashFragment(hash);
+    FOR_EACH_GROUP(table, hash, group)
     {
-        Entry *entry = table->entries + idx;
-        if (entry->key == NULL)
+        uint8_t *control = table->control + group * GROUP_SIZE;
+        for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
         {
-            if (IS_NIL(entry->value))
-                return NULL;
+            ObjString *key = table->entries[group * GROUP_SIZE + __builtin_ctz(match)].key;
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+            {
+                recordProbe(table, step_ + 1);
+                table->stats.stringHits++;
+                return key;
+            }
         }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
-
-            return entry->key;
 
-        idx = (idx + 1) % table->capacity;
+        if (matchByte(control, CTRL_EMPTY) != 0)
+        {
+            recordProbe(table, step_ + 1);
+            table->stats.stringMisses++;
+            return NULL;
+        }
     }
-}
\ No newline at end of file
+}
+
+void printTableStats(FILE *out, const char *name, Table *table)
+{
+    static const char *buckets[PROBE_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17+"};
+    TableStats *stats = &table->stats;
+
+    double load = table->capacity == 0 ? 0 : (double)(table->count + table->tombstones) / table->capacity;
+    double tombstones = table->capacity == 0 ? 0 : (double)table->tombstones / table->capacity;
+    fprintf(out, "[%s] %d entries, %d tombstones, capacity %d, load %.2f, tombstone ratio %.2f\n",
+            name, table->count, table->tombstones, table->capacity, load, tombstones);
+    fprintf(out, "[%s] %llu resizes, %llu rehashes in place\n", name,
+            (unsigned long long)stats->resizes, (unsigned long long)stats->rehashes);
+
+    uint64_t lookups = 0;
+    for (int i = 0; i < PROBE_BUCKETS; i++)
+        lookups += stats->probes[i];
+
+    fprintf(out, "[%s] %llu lookups, longest probe %d groups, by groups probed:", name,
+            (unsigned long long)lookups, stats->longestProbe);
+    for (int i = 0; i < PROBE_BUCKETS; i++)
+        fprintf(out, " %s: %llu", buckets[i], (unsigned long long)stats->probes[i]);
+    fprintf(out, "\n");
+
+    uint64_t finds = stats->stringHits + stats->stringMisses;
+    if (finds > 0)
+        fprintf(out, "[%s] string lookups: %llu hits, %llu misses (%.1f%% hit rate)\n", name,
+                (unsigned long long)stats->stringHits, (unsigned long long)stats->stringMisses,
+                100.0 * stats->stringHits / finds);
+}
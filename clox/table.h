@@ -1,6 +1,8 @@
 #ifndef clox_table_h
 #define clox_table_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "value.h"
 
@@ -10,11 +12,35 @@ typedef struct
     Value value;
 } Entry;
 
+// Lookups are bucketed by how many groups they had to look at:
+// 1, 2, 3-4, 5-8, 9-16 and anything longer
+#define PROBE_BUCKETS 6
+
+// Always on, they cost an increment or two per lookup
+typedef struct
+{
+    uint64_t probes[PROBE_BUCKETS]; // Lookup count per probe length
+    uint64_t stringHits;            // tableFindString() found it,
+    uint64_t stringMisses;          // i.e. interning hits / misses
+    uint64_t resizes;               // Grown to a new capacity
+    uint64_t rehashes;              // Rebuilt in place to drop tombstones
+    int longestProbe;               // In groups
+} TableStats;
+
+/*
+A Swiss table: next to the entries there is one control byte per slot,
+holding either the low 7 bits of the key's hash or a marker for an
+empty / deleted slot. Lookups compare 16 control bytes at a time and
+only touch an entry once its hash fragment matches.
+*/
 typedef struct
 {
-    int count;
-    int capacity;
+    int count;      // Live entries
+    int tombstones; // Deleted slots that still stretch probe sequences
+    int capacity;   // Zero or a power of two, at least one group
+    uint8_t *control;
     Entry *entries;
+    TableStats stats;
 } Table;
 
 void initTable(Table *table);
@@ -24,5 +50,6 @@ bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
+void printTableStats(FILE *out, const char *name, Table *table);
 
 #endif
@@ -0,0 +1,134 @@
+/*
+External strings through the embedding API: the script prints,
+compares and concatenates strings that still sit in the host's
+buffers, hands one to a native function, and leaves results behind
+for loxGetGlobal(). Every buffer has to be released exactly once, the
+long ones by loxFreeVM() and no earlier, and what the script printed
+has to come out through loxSetOutput().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lox.h"
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                              \
+    do                                                     \
+    {                                                      \
+        if (!(condition))                                  \
+        {                                                  \
+            fprintf(stderr, "embed.c:%d: ", __LINE__);     \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fprintf(stderr, "\n");                         \
+            failures++;                                    \
+        }                                                  \
+    } while (false)
+
+typedef struct
+{
+    char *chars;
+    int length;
+    int releases;
+} Buffer;
+
+static void release(void *owner, const char *chars, int length)
+{
+    Buffer *buffer = owner;
+    CHECK(chars == buffer->chars && length == buffer->length, "released the wrong characters");
+    buffer->releases++;
+}
+
+static Buffer makeBuffer(const char *text)
+{
+    Buffer buffer = {NULL, (int)strlen(text), 0};
+    // Not NUL terminated, the VM has to go by the length
+    buffer.chars = malloc(buffer.length);
+    memcpy(buffer.chars, text, buffer.length);
+    return buffer;
+}
+
+typedef struct
+{
+    char text[1024];
+    size_t length;
+} Captured;
+
+static void capture(void *context, const char *chars, size_t length)
+{
+    Captured *captured = context;
+    if (captured->length + length < sizeof(captured->text))
+    {
+        memcpy(captured->text + captured->length, chars, length);
+        captured->length += length;
+    }
+}
+
+static const char *script =
+    "print greeting;\n"
+    "print greeting == \"hello from the host, not copied\";\n"
+    "print greeting == again;\n"
+    "print greeting == short;\n"
+    "print short == \"hi host\";\n"
+    "var joined = greeting + \" and \" + short;\n"
+    "print joined;\n"
+    "var long = greeting + greeting + greeting;\n"
+    "print long == greeting + greeting + greeting;\n"
+    "var p = pipe();\n"
+    "write(pipeWriter(p), greeting);\n"
+    "print read(p) == greeting;\n";
+
+static const char *expected =
+    "hello from the host, not copied\n"
+    "true\n"
+    "true\n"
+    "false\n"
+    "true\n"
+    "hello from the host, not copied and hi host\n"
+    "true\n"
+    "true\n";
+
+int main()
+{
+    Buffer greeting = makeBuffer("hello from the host, not copied");
+    Buffer again = makeBuffer("hello from the host, not copied");
+    Buffer shortText = makeBuffer("hi host");
+    Captured output = {{0}, 0};
+
+    LoxVM *vm = loxNewVM();
+    loxSetOutput(vm, capture, &output, LOX_FLUSH_LINE);
+    loxSetGlobalString(vm, "greeting", greeting.chars, greeting.length, release, &greeting);
+    loxSetGlobalString(vm, "again", again.chars, again.length, release, &again);
+    loxSetGlobalString(vm, "short", shortText.chars, shortText.length, release, &shortText);
+
+    LoxResult result = loxInterpret(vm, script);
+    CHECK(result == LOX_OK, "the script failed with %d", result);
+    CHECK(output.length == strlen(expected) && memcmp(output.text, expected, output.length) == 0,
+          "printed:\n%.*s", (int)output.length, output.text);
+
+    LoxValue value;
+    CHECK(loxGetGlobal(vm, "greeting", &value) && value.type == LOX_STRING &&
+              value.string == greeting.chars && value.length == greeting.length,
+          "greeting isn't the host's string any more");
+    const char *joined = "hello from the host, not copied and hi host";
+    CHECK(loxGetGlobal(vm, "joined", &value) && value.type == LOX_STRING &&
+              value.length == (int)strlen(joined) && memcmp(value.string, joined, value.length) == 0,
+          "joined is %.*s", value.length, value.string);
+    CHECK(loxGetGlobal(vm, "long", &value) && value.length == 3 * greeting.length,
+          "long is %d characters", value.length);
+
+    // Still in use until the VM is gone. A string short enough to fit
+    // in a value was copied into it and could go right away.
+    CHECK(greeting.releases + again.releases == 0, "released too early");
+    loxFreeVM(vm);
+    CHECK(greeting.releases == 1, "greeting released %d times", greeting.releases);
+    CHECK(again.releases == 1, "again released %d times", again.releases);
+    CHECK(shortText.releases == 1, "short released %d times", shortText.releases);
+
+    free(greeting.chars);
+    free(again.chars);
+    free(shortText.chars);
+    return failures == 0 ? 0 : 1;
+}
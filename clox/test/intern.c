@@ -0,0 +1,136 @@
+#define _POSIX_C_SOURCE 200809L
+
+/*
+The sharded intern table: threads with a VM each intern the same texts
+at the same time, half through copyString() and half the way
+concatenation does it, and must all end up with the same pointers.
+Each string is then held once per VM, and VMs coming and going
+concurrently must neither free a string another VM holds nor leave
+one behind.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "vm.h"
+
+#define THREADS 8
+#define TEXTS 2000
+#define CHURN 50
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                              \
+    do                                                     \
+    {                                                      \
+        if (!(condition))                                  \
+        {                                                  \
+            fprintf(stderr, "intern.c:%d: ", __LINE__);    \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fprintf(stderr, "\n");                         \
+            if (++failures > 10)                           \
+                return;                                    \
+        }                                                  \
+    } while (false)
+
+static char texts[TEXTS][48];
+static int lengths[TEXTS];
+
+static VM vms[THREADS];
+static ObjString *interned[THREADS][TEXTS];
+static pthread_barrier_t start;
+
+static ObjString *intern(VM *vm, int i, bool copy)
+{
+    if (copy)
+        return copyString(vm, texts[i], lengths[i]);
+
+    ObjString *string = reserveString(lengths[i]);
+    memcpy(string->chars, texts[i], lengths[i]);
+    return internString(vm, string);
+}
+
+// Every thread goes through the texts from a different place
+static void *internAll(void *arg)
+{
+    int thread = (int)(intptr_t)arg;
+    pthread_barrier_wait(&start);
+    for (int n = 0; n < TEXTS; n++)
+    {
+        int i = (n + thread * TEXTS / THREADS) % TEXTS;
+        interned[thread][i] = intern(&vms[thread], i, (i + thread) % 2 == 0);
+    }
+    return NULL;
+}
+
+// VMs that only live for a moment, interning and dropping the texts
+static void *churn(void *arg)
+{
+    int thread = (int)(intptr_t)arg;
+    pthread_barrier_wait(&start);
+    for (int round = 0; round < CHURN; round++)
+    {
+        VM vm;
+        initVM(&vm);
+        for (int i = (round + thread) % 7; i < TEXTS; i += 7)
+            intern(&vm, i, round % 2 == 0);
+        freeVM(&vm);
+    }
+    return NULL;
+}
+
+static void runThreads(void *(*body)(void *))
+{
+    pthread_t threads[THREADS];
+    pthread_barrier_init(&start, NULL, THREADS);
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, body, (void *)(intptr_t)i);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&start);
+}
+
+static void sameStrings()
+{
+    for (int i = 0; i < TEXTS; i++)
+    {
+        ObjString *string = interned[0][i];
+        CHECK(string->length == lengths[i] && memcmp(string->chars, texts[i], lengths[i]) == 0,
+              "text %d interned as %.*s", i, string->length, string->chars);
+        for (int thread = 1; thread < THREADS; thread++)
+            CHECK(interned[thread][i] == string, "text %d has two copies", i);
+        CHECK(string->refs == THREADS, "text %d has %d references", i, string->refs);
+    }
+}
+
+int main()
+{
+    for (int i = 0; i < TEXTS; i++)
+        lengths[i] = snprintf(texts[i], sizeof(texts[i]), "%.*s%d", i % 32, "interned string interned string", i);
+
+    for (int i = 0; i < THREADS; i++)
+        initVM(&vms[i]);
+    runThreads(internAll);
+    sameStrings();
+
+    // The strings the VMs hold stay put while others come and go
+    runThreads(churn);
+    sameStrings();
+
+    // Once the last VM is gone the shards are empty again, a new VM
+    // has to start from scratch
+    for (int i = 0; i < THREADS; i++)
+        freeVM(&vms[i]);
+    VM vm;
+    initVM(&vm);
+    ObjString *string = copyString(&vm, texts[TEXTS - 1], lengths[TEXTS - 1]);
+    if (string->refs != 1)
+    {
+        fprintf(stderr, "intern.c: a string outlived every VM with %d references\n", string->refs);
+        failures++;
+    }
+    freeVM(&vm);
+    return failures == 0 ? 0 : 1;
+}
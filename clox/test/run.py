@@ -0,0 +1,98 @@
+"""
+Runs the regression tests, `make test` calls it.
+
+    python3 test/run.py ./main [test/driver ...]
+
+Every test/*.lox script is run with the interpreter. Its output has to
+be the `// expect: ...` comments in order, and a script with an
+`// expect runtime error: ...` comment has to fail with exit code 70
+and that message as the first line on stderr. The drivers given after
+the interpreter are small C programs that check the library from the
+inside and exit with status 0 if they passed.
+"""
+
+import glob
+import os
+import re
+import subprocess
+import sys
+
+TIMEOUT = 60
+EXPECT = re.compile(r"// expect: ?(.*)")
+EXPECT_ERROR = re.compile(r"// expect runtime error: (.+)")
+
+
+def runScript(interpreter, path):
+    expected = []
+    expectedError = None
+    with open(path) as source:
+        for line in source:
+            match = EXPECT.search(line)
+            if match:
+                expected.append(match.group(1))
+            match = EXPECT_ERROR.search(line)
+            if match:
+                expectedError = match.group(1)
+
+    result = subprocess.run([interpreter, path], capture_output=True,
+                            text=True, timeout=TIMEOUT)
+    failures = []
+    output = result.stdout.splitlines()
+    if output != expected:
+        for i in range(max(len(output), len(expected))):
+            got = output[i] if i < len(output) else "<nothing>"
+            want = expected[i] if i < len(expected) else "<nothing>"
+            if got != want:
+                failures.append("line %d of the output: expected %r, got %r"
+                                % (i + 1, want, got))
+                break
+
+    if expectedError is not None:
+        errors = result.stderr.splitlines()
+        if result.returncode != 70:
+            failures.append("expected exit code 70, got %d" % result.returncode)
+        if not errors or errors[0] != expectedError:
+            failures.append("expected runtime error %r, got %r"
+                            % (expectedError, errors[0] if errors else ""))
+    elif result.returncode != 0 or result.stderr:
+        failures.append("exit code %d: %s" % (result.returncode, result.stderr.strip()))
+    return failures
+
+
+def runDriver(path):
+    result = subprocess.run([path], capture_output=True, text=True, timeout=TIMEOUT)
+    if result.returncode == 0:
+        return []
+    return ["exit code %d: %s" % (result.returncode,
+                                  (result.stdout + result.stderr).strip())]
+
+
+def main():
+    interpreter = sys.argv[1]
+    drivers = sys.argv[2:]
+    here = os.path.dirname(os.path.abspath(__file__))
+    tests = [(path, lambda path=path: runScript(interpreter, path))
+             for path in sorted(glob.glob(os.path.join(here, "*.lox")))]
+    tests += [(path, lambda path=path: runDriver(path)) for path in drivers]
+
+    failed = 0
+    for path, run in tests:
+        name = os.path.relpath(path)
+        try:
+            failures = run()
+        except subprocess.TimeoutExpired:
+            failures = ["timed out after %d seconds" % TIMEOUT]
+        if failures:
+            failed += 1
+            print("FAIL %s" % name)
+            for failure in failures:
+                print("    " + failure)
+        else:
+            print("pass %s" % name)
+
+    print("%d of %d tests passed" % (len(tests) - failed, len(tests)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
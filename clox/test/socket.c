@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+
+/*
+Fibers waiting on a socket: one end of a socketpair goes to the script,
+the other to a peer thread that only writes after a while. The fiber
+reading from the socket has to be parked in the event loop while the
+others, and the script itself, keep running, then wake up to the data,
+echo it back doubled and see the end of the stream once the peer hangs
+up.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lox.h"
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                              \
+    do                                                     \
+    {                                                      \
+        if (!(condition))                                  \
+        {                                                  \
+            fprintf(stderr, "socket.c:%d: ", __LINE__);    \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fprintf(stderr, "\n");                         \
+            failures++;                                    \
+        }                                                  \
+    } while (false)
+
+#define MESSAGE "a message from the peer"
+
+static void *peer(void *arg)
+{
+    int fd = *(int *)arg;
+    struct timespec delay = {0, 50 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+    CHECK(write(fd, MESSAGE, strlen(MESSAGE)) == (ssize_t)strlen(MESSAGE), "the peer couldn't write");
+
+    char reply[2 * sizeof(MESSAGE)];
+    size_t length = 0;
+    while (length < 2 * strlen(MESSAGE))
+    {
+        ssize_t n = read(fd, reply + length, sizeof(reply) - length);
+        if (n <= 0)
+            break;
+        length += n;
+    }
+    CHECK(length == 2 * strlen(MESSAGE) && memcmp(reply, MESSAGE MESSAGE, length) == 0,
+          "the peer got back %.*s", (int)length, reply);
+
+    close(fd);
+    return NULL;
+}
+
+typedef struct
+{
+    char text[1024];
+    size_t length;
+} Captured;
+
+static void capture(void *context, const char *chars, size_t length)
+{
+    Captured *captured = context;
+    if (captured->length + length < sizeof(captured->text))
+    {
+        memcpy(captured->text + captured->length, chars, length);
+        captured->length += length;
+    }
+}
+
+// The reader prints 2 only once the peer wrote, long after the script
+// printed 1 and while the ticker kept going
+static const char *script =
+    "var sock = %d;\n"
+    "var got = nil;\n"
+    "var eof = false;\n"
+    "var ticks = 0;\n"
+    "fiber(\"got = read(sock); print 2; write(sock, got + got); eof = read(sock) == nil;\");\n"
+    "fiber(\"while (got == nil) { ticks = ticks + 1; sleep(5); }\");\n"
+    "print 1;\n"
+    "while (!eof) sleep(1);\n"
+    "print 3;\n"
+    "print got;\n"
+    "print ticks > 2;\n"
+    "close(sock);\n";
+
+static const char *expected =
+    "1\n"
+    "2\n"
+    "3\n" MESSAGE "\n"
+    "true\n";
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, peer, &fds[1]);
+
+    char source[1024];
+    snprintf(source, sizeof(source), script, fds[0]);
+    Captured output = {{0}, 0};
+    LoxVM *vm = loxNewVM();
+    loxSetOutput(vm, capture, &output, LOX_FLUSH_LINE);
+    LoxResult result = loxInterpret(vm, source);
+    CHECK(result == LOX_OK, "the script failed with %d", result);
+    CHECK(output.length == strlen(expected) && memcmp(output.text, expected, output.length) == 0,
+          "printed:\n%.*s", (int)output.length, output.text);
+    loxFreeVM(vm);
+
+    pthread_join(thread, NULL);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+/*
+Swiss table churn: keys are inserted and deleted in a sliding window
+over a table filled close to its load limit, which leaves tombstones
+behind. Lookups have to find every live key and none of the deleted
+ones through them, rehashing in place has to clear them out, and the
+capacity must stay where the live keys need it rather than grow with
+every key ever inserted.
+*/
+
+#include <stdio.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEYS 40000
+#define FILL 1500  // Of 2048 slots
+#define WINDOW 500
+#define CROWD 760 // Just below the load limit of 1024 slots
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                              \
+    do                                                     \
+    {                                                      \
+        if (!(condition))                                  \
+        {                                                  \
+            fprintf(stderr, "table.c:%d: ", __LINE__);     \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fprintf(stderr, "\n");                         \
+            if (++failures > 10)                           \
+                return;                                    \
+        }                                                  \
+    } while (false)
+
+static ObjString *keys[KEYS];
+
+static void makeKeys(VM *vm)
+{
+    char text[32];
+    for (int i = 0; i < KEYS; i++)
+    {
+        int length = snprintf(text, sizeof(text), "key number %d", i);
+        keys[i] = copyString(vm, text, length);
+    }
+}
+
+// Keys first to last - 1 are in the table with their index as value
+static void checkWindow(Table *table, int first, int last)
+{
+    CHECK(table->count == last - first, "%d entries, expected %d", table->count, last - first);
+    for (int i = first < FILL ? 0 : first - FILL; i < last + FILL && i < KEYS; i++)
+    {
+        Value value;
+        bool found = tableGet(table, keys[i], &value);
+        if (i >= first && i < last)
+            CHECK(found && AS_NUMBER(value) == i, "key %d missing", i);
+        else
+            CHECK(!found, "key %d found, outside %d-%d", i, first, last);
+    }
+}
+
+static void slidingWindow(VM *vm)
+{
+    Table table;
+    initTable(&table);
+
+    // Filled up to just below the load limit most groups are full, so
+    // what gets deleted from them now leaves tombstones
+    int first = 0;
+    for (int i = 0; i < FILL; i++)
+        CHECK(tableSet(&table, keys[i], NUMBER_VAL(i)), "key %d was already there", i);
+    int capacity = table.capacity;
+
+    // Then the window slides on and shrinks down to WINDOW keys
+    for (int i = FILL; i < KEYS; i++)
+    {
+        CHECK(tableSet(&table, keys[i], NUMBER_VAL(i)), "key %d was already there", i);
+        CHECK(tableDelete(&table, keys[first]), "key %d not deleted", first);
+        first++;
+        if (i + 1 - first > WINDOW)
+        {
+            CHECK(tableDelete(&table, keys[first]), "key %d not deleted", first);
+            first++;
+        }
+        if (i % 997 == 0)
+            checkWindow(&table, first, i + 1);
+    }
+    checkWindow(&table, first, KEYS);
+
+    CHECK(table.tombstones > 0, "no tombstones left by %d deletes", first);
+    CHECK(table.capacity == capacity, "capacity went from %d to %d", capacity, table.capacity);
+
+    for (int i = first; i < KEYS; i++)
+        CHECK(tableDelete(&table, keys[i]), "key %d not deleted", i);
+    CHECK(table.count == 0, "%d entries left", table.count);
+    CHECK(!tableDelete(&table, keys[0]), "deleted a key twice");
+    freeTable(&table);
+}
+
+// Keys that all want to sit in the first group of a 1024 slot table
+// fill the groups along its probe sequence, so deleting them leaves
+// nothing but tombstones. Inserting other keys then has to rehash in
+// place instead of growing the table.
+static void crowd(VM *vm)
+{
+    static ObjString *crowded[CROWD];
+    char text[32];
+    for (int i = 0, count = 0; count < CROWD; i++)
+    {
+        int length = snprintf(text, sizeof(text), "crowd %d", i);
+        ObjString *key = copyString(vm, text, length);
+        if (((key->hash >> 7) & 1023) < 16)
+            crowded[count++] = key;
+    }
+
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < CROWD; i++)
+        tableSet(&table, crowded[i], NUMBER_VAL(i));
+    CHECK(table.capacity == 1024, "capacity %d for %d keys", table.capacity, CROWD);
+    for (int i = 0; i < CROWD; i++)
+        CHECK(tableDelete(&table, crowded[i]), "crowded key %d not deleted", i);
+    CHECK(table.tombstones > CROWD / 2, "only %d tombstones", table.tombstones);
+
+    for (int i = 0; i < 300; i++)
+    {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+        for (int j = 0; j < CROWD; j += 37)
+        {
+            Value value;
+            CHECK(!tableGet(&table, crowded[j], &value), "crowded key %d found", j);
+        }
+    }
+    checkWindow(&table, 0, 300);
+    CHECK(table.stats.rehashes == 1, "%llu rehashes in place",
+          (unsigned long long)table.stats.rehashes);
+    CHECK(table.capacity == 1024, "capacity went up to %d", table.capacity);
+    CHECK(table.tombstones == 0, "%d tombstones after rehashing", table.tombstones);
+    freeTable(&table);
+}
+
+// Deleting and putting back the same keys over and over
+static void reinsert(VM *vm)
+{
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < 500; i++)
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    int capacity = table.capacity;
+
+    for (int round = 0; round < 200; round++)
+    {
+        for (int i = round % 2; i < 500; i += 2)
+            CHECK(tableDelete(&table, keys[i]), "round %d: key %d not deleted", round, i);
+        for (int i = round % 2; i < 500; i += 2)
+        {
+            Value value;
+            CHECK(!tableGet(&table, keys[i], &value), "round %d: deleted key %d found", round, i);
+            CHECK(tableSet(&table, keys[i], NUMBER_VAL(round)), "round %d: key %d still there",
+                  round, i);
+        }
+    }
+    CHECK(table.count == 500, "%d entries, expected 500", table.count);
+    CHECK(table.capacity == capacity, "capacity went from %d to %d", capacity, table.capacity);
+    for (int i = 0; i < 500; i++)
+    {
+        Value value;
+        CHECK(tableGet(&table, keys[i], &value) && AS_NUMBER(value) == 198 + i % 2,
+              "key %d lost its value", i);
+    }
+    freeTable(&table);
+}
+
+int main()
+{
+    VM vm;
+    initVM(&vm);
+    makeKeys(&vm);
+    slidingWindow(&vm);
+    crowd(&vm);
+    reinsert(&vm);
+    freeVM(&vm);
+    return failures == 0 ? 0 : 1;
+}
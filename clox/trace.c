@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+bool tracing = false;
+
+static FILE *file;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t startNs;
+static int64_t allocated;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool startTrace(const char *path)
+{
+    file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    startNs = nowNs();
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"clox\"}}",
+            (int)getpid());
+    tracing = true;
+    return true;
+}
+
+void stopTrace()
+{
+    if (!tracing)
+        return;
+
+    pthread_mutex_lock(&lock);
+    tracing = false;
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    file = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+// Timestamps are in microseconds, kept to the nanosecond
+static void writeEvent(const char *name, char phase, const char *args)
+{
+    double ts = (nowNs() - startNs) / 1000.0;
+    unsigned long tid = (unsigned long)pthread_self();
+
+    pthread_mutex_lock(&lock);
+    if (file != NULL)
+        fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %lu%s}",
+                name, phase, ts, (int)getpid(), tid, args);
+    pthread_mutex_unlock(&lock);
+}
+
+void traceBegin(const char *name)
+{
+    if (tracing)
+        writeEvent(name, 'B', "");
+}
+
+void traceEnd(const char *name)
+{
+    if (!tracing)
+        return;
+    writeEvent(name, 'E', "");
+    traceHeap();
+}
+
+void traceCounter(const char *name, int64_t value)
+{
+    if (!tracing)
+        return;
+
+    char args[64];
+    snprintf(args, sizeof(args), ", \"args\": {\"value\": %lld}", (long long)value);
+    writeEvent(name, 'C', args);
+}
+
+void traceAllocation(int64_t delta)
+{
+    __atomic_fetch_add(&allocated, delta, __ATOMIC_RELAXED);
+}
+
+void traceHeap()
+{
+    traceCounter("heap", __atomic_load_n(&allocated, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,45 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+
+/*
+An opt-in timeline of what the interpreter spends its time on,
+written as Chrome trace events (load the file in chrome://tracing or
+ui.perfetto.dev). Phases are spans:
+
+- init: creating a VM and defining its natives
+- read: reading the script from disk
+- compile: scanning and compiling, which happen in one pass, with
+  the stack depth analysis that follows it as a nested span
+- run: each stretch of execution between interpret() / resume() and
+  the VM giving control back
+- free: tearing a VM down
+
+A garbage collector would add a span of its own per cycle in the
+same way.
+
+Counters track the bytes the process allocated through reallocate()
+since the trace started, and the depth of the VM's stack. They are
+sampled whenever a span ends and, while a script runs, every time it
+uses up a slice of fuel (see vm.h).
+
+Events from every thread go to the same file, each with its own
+tid. The tracer is off unless startTrace() is called; until then each
+hook costs one branch.
+*/
+
+extern bool tracing;
+
+bool startTrace(const char *path);
+void stopTrace();
+
+void traceBegin(const char *name);
+void traceEnd(const char *name);
+void traceCounter(const char *name, int64_t value);
+// Called by reallocate() with the change in allocated bytes
+void traceAllocation(int64_t delta);
+// The heap counter, as of now
+void traceHeap();
+
+#endif
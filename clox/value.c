@@ -3,6 +3,7 @@
 
 #include "value.h"
 #include "memory.h"
+#include "number.h"
 #include "object.h"
 
 bool valuesEqual(Value a, Value b)
@@ -27,7 +28,13 @@ bool valuesEqual(Value a, Value b)
 
     // After string interning, address equality <=> value equality
     case VAL_OBJ:
+        // Except for ropes and external strings, which are
+        // compared by content
+        if (IS_ROPE(a) || IS_ROPE(b) || IS_EXTERNAL(a) || IS_EXTERNAL(b))
+            return IS_TEXT(a) && IS_TEXT(b) && textsEqual(a, b);
         return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_SHORT_STRING:
+        return a.length == b.length && memcmp(a.as.chars, b.as.chars, a.length) == 0;
     default:
         return false;
     }
@@ -69,10 +76,17 @@ void printValue(Value value)
         printf("nil");
         break;
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+    {
+        char buffer[NUMBER_MAX];
+        formatNumber(AS_NUMBER(value), buffer);
+        printf("%s", buffer);
         break;
+    }
     case VAL_OBJ:
         printObj(value);
         break;
+    case VAL_SHORT_STRING:
+        printf("%.*s", value.length, value.as.chars);
+        break;
     }
 }
\ No newline at end of file
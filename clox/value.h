@@ -12,16 +12,22 @@ typedef enum
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_SHORT_STRING,
 } ValueType;
 
+// Strings up to this long live inside the Value, see shortString()
+#define SHORT_STRING_MAX 8
+
 typedef struct
 {
     ValueType type;
+    int length; // Of a short string, it sits in what used to be padding
     union
     {
         bool boolean;
         double number;
         Obj *obj;
+        char chars[SHORT_STRING_MAX];
     } as;
 } Value;
 
@@ -36,17 +42,32 @@ typedef struct
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_SHORT_STRING(value) ((value).type == VAL_SHORT_STRING)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 
-#define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
-#define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)value}})
+#define BOOL_VAL(value) ((Value){VAL_BOOL, 0, {.boolean = value}})
+#define NIL_VAL ((Value){VAL_NIL, 0, {.number = 0}})
+#define NUMBER_VAL(value) ((Value){VAL_NUMBER, 0, {.number = value}})
+#define OBJ_VAL(value) ((Value){VAL_OBJ, 0, {.obj = (Obj *)value}})
 // We need to cast the pointer to `Obj*` type so that the struct is compatible
 
+/*
+A string of at most SHORT_STRING_MAX characters is kept in the Value
+itself, no heap object at all. There is only ever one representation
+of a given string (short strings are never made into ObjStrings that
+end up on the stack), so equality is still a plain comparison.
+*/
+static inline Value shortString(const char *chars, int length)
+{
+    Value value = {VAL_SHORT_STRING, length, {.number = 0}};
+    for (int i = 0; i < length; i++)
+        value.as.chars[i] = chars[i];
+    return value;
+}
+
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray *array);
 void freeValueArray(ValueArray *array);
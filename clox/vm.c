@@ -1,22 +1,29 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "debug.h"
 #include "compiler.h"
+#include "counters.h"
+#include "intern.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
-
-static void resetStack()
+static void resetStack(VM *vm)
 {
-    vm.stackTop = vm.stack;
+    vm->stackTop = vm->stack;
 }
 
-static void runtimeError(const char *format, ...)
+void runtimeError(VM *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -24,41 +31,146 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputc('\n', stderr);
 
-    int instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    int instruction = vm->ip - vm->chunk->code - 1;
+    int line = vm->chunk->lines[instruction];
     fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    if (vm->history.record)
+        dumpHistory(vm, STDERR_FILENO, "runtime error");
+    resetStack(vm);
+}
+
+void initVM(VM *vm)
+{
+    traceBegin("init");
+    initChunk(&vm->script);
+    initFibers(vm);
+    vm->objects = NULL;
+    initOutput(&vm->output);
+    initHistory(&vm->history);
+#ifdef PROFILE_OPCODES
+    initProfile(&vm->profile);
+#endif
+    initTable(&vm->strings);
+    initTable(&vm->globals);
+
+    vm->chunk = NULL;
+    vm->sampling = false;
+    vm->sampleIp = NULL;
+    setBudget(vm, -1, 0);
+    setDiagnostics(vm, false, false, 0, INT_MAX);
+
+    defineNatives(vm);
+    traceEnd("init");
+}
+
+void freeVM(VM *vm)
+{
+    traceBegin("free");
+    freeOutput(&vm->output);
+#ifdef PROFILE_OPCODES
+    freeProfile(&vm->profile);
+#endif
+    freeObjects(vm);
+    releaseStrings(&vm->strings);
+    freeTable(&vm->strings);
+    freeTable(&vm->globals);
+    freeFibers(vm);
+    freeChunk(&vm->script);
+    traceEnd("free");
+}
+
+/*
+Params
+------
+- fuel: type int64_t, bytecode bytes each interpret() / resume()
+        may loop over before yielding, negative for unlimited
+- timeoutMs: type int64_t, wall-clock milliseconds each call
+        may run before yielding, 0 for unlimited
+*/
+void setBudget(VM *vm, int64_t fuel, int64_t timeoutMs)
+{
+    vm->fuelLimit = fuel < 0 ? -1 : fuel;
+    vm->timeLimitNs = timeoutMs > 0 ? timeoutMs * 1000000 : 0;
+}
+
+/*
+Params
+------
+- disassemble: type bool, print each chunk after compiling it
+- trace: type bool, print every instruction before running it,
+         along with the stack. Scripts run on an instrumented copy
+         of the loop while this is on, the usual one has no checks.
+- firstLine, lastLine: type int, only trace the instructions
+         compiled from these lines, inclusive
+*/
+void setDiagnostics(VM *vm, bool disassemble, bool trace, int firstLine, int lastLine)
+{
+    vm->disassemble = disassemble;
+    vm->traceExecution = trace;
+    vm->traceFirstLine = firstLine;
+    vm->traceLastLine = lastLine;
 }
 
-void initVM()
+static int64_t monotonicNs()
 {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void freeVM()
+static void giveSlice(VM *vm)
 {
-    freeObjects();
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    int64_t slice = FUEL_SLICE;
+    if (vm->budget >= 0)
+    {
+        if (vm->budget < slice)
+            slice = vm->budget;
+        vm->budget -= slice;
+    }
+    vm->fuel = slice;
 }
 
-void push(Value value)
+static void startSlice(VM *vm)
 {
-    *vm.stackTop++ = value;
+    vm->budget = vm->fuelLimit;
+    vm->deadline = vm->timeLimitNs > 0 ? monotonicNs() + vm->timeLimitNs : 0;
+    giveSlice(vm);
 }
 
-Value pop()
+// Slow path of the fuel check, only reached once the current
+// slice runs dry, and kept out of run(). Returns true when the VM
+// has to yield.
+static __attribute__((noinline)) bool outOfFuel(VM *vm)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    if (vm->budget == 0)
+        return true;
+    if (vm->deadline != 0 && monotonicNs() >= vm->deadline)
+        return true;
+
+    if (tracing)
+    {
+        traceCounter("stack", vm->stackTop - vm->stack);
+        traceHeap();
+    }
+
+    giveSlice(vm);
+    return false;
 }
 
-static Value peek(int distance)
+void push(VM *vm, Value value)
 {
-    return vm.stackTop[-1 - distance];
+    *vm->stackTop++ = value;
+}
+
+Value pop(VM *vm)
+{
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(VM *vm, int distance)
+{
+    return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value)
@@ -66,81 +178,247 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static bool callValue(VM *vm, Value callee, int argCount)
 {
-    ObjString *s2 = AS_STRING(pop());
-    ObjString *s1 = AS_STRING(pop());
+    if (IS_NATIVE(callee))
+    {
+        ObjNative *native = AS_NATIVE(callee);
+        if (argCount != native->arity)
+        {
+            runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+            return false;
+        }
 
-    int length = s1->length + s2->length;
-    char *final = ALLOCATE(char, length + 1);
-    memcpy(final, s1->chars, s1->length);
-    memcpy(final + s1->length, s2->chars, s2->length);
-    final[length] = '\0';
+        Value *args = vm->stackTop - argCount;
+        for (int i = 0; i < argCount; i++)
+        {
+            // Natives only ever see interned ObjStrings
+            if (IS_TEXT(args[i]))
+                args[i] = OBJ_VAL(toObjString(vm, args[i]));
+        }
+
+        if (!native->function(vm, argCount, args))
+            return false;
+
+        // The native parked the fiber, the call is retried later
+        if (vm->fiber->state != FIBER_RUNNING)
+            return true;
+
+        // The result sits in the callee's slot, and a short string
+        // has to be turned back into one
+        Value result = args[-1];
+        if (IS_STRING(result) && AS_STRING(result)->length <= SHORT_STRING_MAX)
+            args[-1] = shortString(AS_STRING(result)->chars, AS_STRING(result)->length);
+        vm->stackTop = args;
+        return true;
+    }
 
-    ObjString *str = takeString(final, length);
-    push(OBJ_VAL(str));
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
 }
 
-static InterpretResult run()
+// Copy flat strings into one exact-size string and intern it.
+// Short results are built right inside the Value.
+static Value joinStrings(VM *vm, Value *strings, int count, int length)
 {
-#define READ_BYTE() (*vm.ip++)
-#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define BINARY_OP(valueType, op)                            \
+    char buffer[SHORT_STRING_MAX];
+    ObjString *string = NULL;
+    char *end = buffer;
+    if (length > SHORT_STRING_MAX)
+    {
+        string = reserveString(length);
+        end = string->chars;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        int pieceLength = textLength(strings[i]);
+        memcpy(end, textChars(&strings[i]), pieceLength);
+        end += pieceLength;
+    }
+
+    if (string == NULL)
+        return shortString(buffer, length);
+    return OBJ_VAL(internString(vm, string));
+}
+
+static Value concatenate(VM *vm, Value *operands)
+{
+    int aLength = textLength(operands[0]);
+    int bLength = textLength(operands[1]);
+
+    if (bLength == 0)
+        return operands[0];
+    if (aLength == 0)
+        return operands[1];
+    if (aLength + bLength >= ROPE_MIN)
+        return OBJ_VAL(newRope(vm, operands[0], operands[1]));
+
+    // Ropes are never shorter than ROPE_MIN, so both sides are
+    // flat here. Short strings are cheaper to copy and intern.
+    return joinStrings(vm, operands, 2, aLength + bLength);
+}
+
+/*
+OP_CONCAT: the operands of a chain like "a" + "b" + c, leaving their
+sum in the slot of the first one. The compiler only folds string
+literals, and one operand of any kind at the end.
+
+When they are all flat strings (anything but ropes), they're joined with one allocation,
+one copy and one hash. Anything else (a number or a rope at the end) is added
+pairwise from the left exactly like a run of OP_ADDs would.
+*/
+static bool concatenateMany(VM *vm, int count)
+{
+    Value *operands = vm->stackTop - count;
+
+    int length = 0;
+    int strings = 0;
+    while (strings < count && IS_TEXT(operands[strings]) && !IS_ROPE(operands[strings]))
+        length += textLength(operands[strings++]);
+
+    if (strings == count)
+        operands[0] = joinStrings(vm, operands, count, length);
+    else
+    {
+        for (int i = 1; i < count; i++)
+        {
+            // Keep the running sum next to the operand being added
+            operands[i - 1] = operands[0];
+            if (IS_TEXT(operands[i - 1]) && IS_TEXT(operands[i]))
+                operands[0] = concatenate(vm, &operands[i - 1]);
+            else if (IS_NUMBER(operands[i - 1]) && IS_NUMBER(operands[i]))
+                operands[0] = NUMBER_VAL(AS_NUMBER(operands[i - 1]) + AS_NUMBER(operands[i]));
+            else
+            {
+                runtimeError(vm, "Operands must be two numbers or two strings.");
+                return false;
+            }
+        }
+    }
+
+    vm->stackTop = operands + 1;
+    return true;
+}
+
+// What --trace prints, ahead of the instruction at `ip`
+static void traceInstruction(VM *vm, const uint8_t *ip)
+{
+    int offset = (int)(ip - vm->chunk->code);
+    int line = vm->chunk->lines[offset];
+    if (line < vm->traceFirstLine || line > vm->traceLastLine)
+        return;
+
+    // Both go to stdout, keep what the script printed in order
+    flushOutput(&vm->output);
+
+    printf("[STACK ] [");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+    {
+        printValue(*slot);
+        if (slot + 1 != vm->stackTop)
+            printf(", ");
+    }
+    printf("]\n");
+
+    printf("[OPCODE] ");
+    disassembleInstruction(vm->chunk, offset);
+}
+
+// Always inlined into the versions below, where `sampled`, `traced`
+// and `recorded` are constants, so the plain run() has no trace of
+// any of them.
+static inline __attribute__((always_inline)) InterpretResult dispatch(VM *vm, bool sampled, bool traced,
+                                                                      bool recorded)
+{
+    // Keep the ip in a local so the compiler can hold it in a
+    // register instead of going through vm on every byte. Anything
+    // that looks at vm->ip (errors, natives, fiber switches) has to
+    // see it stored back first, and pick it up again afterwards.
+    uint8_t *ip = vm->ip;
+
+    // Same goes for the count of transfers in the history. Handlers
+    // dumping it (see history.h) see it as of the last write-back.
+    uint32_t transfers = recorded ? vm->history.next : 0;
+    if (recorded)
+        recordTransfer(&vm->history, transfers++, NULL, ip);
+
+#ifdef PROFILE_OPCODES
+    // An instruction timed when the last call returned didn't end
+    // at the next one
+    vm->profile.pending = -1;
+#endif
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define PUBLISH_TRANSFERS() (recorded ? publishTransfers(&vm->history, transfers) : (void)0)
+#define STORE_IP() (vm->ip = ip, PUBLISH_TRANSFERS())
+#define LOAD_IP() (ip = vm->ip)
+#define TRANSFER(from, to) (recorded ? recordTransfer(&vm->history, transfers++, from, to) : (void)0)
+#define CHARGE_FUEL(amount)                                 \
     do                                                      \
     {                                                       \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))     \
+        if ((vm->fuel -= (amount)) <= 0)                    \
         {                                                   \
-            runtimeError("Operands must both be numbers."); \
-            return INTERPRET_RUNTIME_ERROR;                 \
+            /* Once a slice, for dumps from signals */      \
+            PUBLISH_TRANSFERS();                            \
+            if (outOfFuel(vm))                              \
+            {                                               \
+                STORE_IP();                                 \
+                return INTERPRET_YIELD;                     \
+            }                                               \
         }                                                   \
-        double b = AS_NUMBER(pop());                        \
-        double a = AS_NUMBER(pop());                        \
-        push(valueType(a op b));                            \
+    } while (false)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_STRING() (AS_STRING(READ_CONSTANT()))
+#define BINARY_OP(valueType, op)                                \
+    do                                                          \
+    {                                                           \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                                       \
+            STORE_IP();                                         \
+            runtimeError(vm, "Operands must both be numbers."); \
+            return INTERPRET_RUNTIME_ERROR;                     \
+        }                                                       \
+        double b = AS_NUMBER(pop(vm));                          \
+        double a = AS_NUMBER(pop(vm));                          \
+        push(vm, valueType(a op b));                            \
     } while (false)
 
     for (;;)
     {
-#ifdef DEBUG_TRACE_EXECUTION
-
-        printf("[STACK ] [");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printValue(*slot);
-            if (slot + 1 != vm.stackTop)
-                printf(", ");
-        }
-        printf("]\n");
-
-        printf("[OPCODE] ");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+        if (traced)
+            traceInstruction(vm, ip);
+#ifdef PROFILE_OPCODES
+        profileInstruction(&vm->profile, vm->chunk, ip);
 #endif
+        if (sampled)
+            vm->sampleIp = ip;
         switch (READ_BYTE())
         {
         case OP_CONSTANT:
         {
             Value constant = READ_CONSTANT();
-            push(constant);
+            push(vm, constant);
             break;
         }
         case OP_NIL:
-            push(NIL_VAL);
+            push(vm, NIL_VAL);
             break;
         case OP_TRUE:
-            push(BOOL_VAL(true));
+            push(vm, BOOL_VAL(true));
             break;
         case OP_FALSE:
-            push(BOOL_VAL(false));
+            push(vm, BOOL_VAL(false));
             break;
         case OP_POP:
-            pop();
+            pop(vm);
             break;
         case OP_DEFINE_GLOBAL:
         {
             ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
+            tableSet(&vm->globals, name, peek(vm, 0));
+            pop(vm);
             // Note that we don’t pop the value until after
             // we add it to the hash table. That ensures the
             // VM can still find the value if a garbage collection
@@ -152,12 +430,13 @@ static InterpretResult run()
         {
             ObjString *name = READ_STRING();
             Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            if (!tableGet(&vm->globals, name, &value))
             {
-                runtimeError("Undefined variable %s.", name->chars);
+                STORE_IP();
+                runtimeError(vm, "Undefined variable %s.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
+            push(vm, value);
             break;
         }
         case OP_SET_GLOBAL:
@@ -166,13 +445,14 @@ static InterpretResult run()
             // Do not pop the value out. We're just
             // reassign the target variable.
             // Los doesn't do implicit declaration.
-            if (tableSet(&vm.globals, name, peek(0)))
+            if (tableSet(&vm->globals, name, peek(vm, 0)))
             {
                 // If tableSet returns true, indicating
                 // we didn't find a variable in the existing
                 // one, report an error.
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable %s.", name->chars);
+                tableDelete(&vm->globals, name);
+                STORE_IP();
+                runtimeError(vm, "Undefined variable %s.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -187,7 +467,7 @@ static InterpretResult run()
             // are not looked up by name, they live inside the stack.
 
             uint8_t slot = READ_BYTE();
-            push(vm.stack[slot]);
+            push(vm, vm->stack[slot]);
             break;
         }
         case OP_SET_LOCAL:
@@ -197,14 +477,14 @@ static InterpretResult run()
             // command.
 
             uint8_t slot = READ_BYTE();
-            vm.stack[slot] = peek(0);
+            vm->stack[slot] = peek(vm, 0);
             break;
         }
         case OP_EQUAL:
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(a, b)));
             break;
         }
         case OP_GREATER:
@@ -215,21 +495,35 @@ static InterpretResult run()
             break;
         case OP_ADD:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                concatenate();
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
+            {
+                Value result = concatenate(vm, vm->stackTop - 2);
+                pop(vm);
+                pop(vm);
+                push(vm, result);
+            }
+            else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                double b = AS_NUMBER(pop(vm));
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a + b));
             }
             else
             {
-                runtimeError("Operands must be two numbers or two strings.");
+                STORE_IP();
+                runtimeError(vm, "Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
         }
+        case OP_CONCAT:
+        {
+            int count = READ_BYTE();
+            STORE_IP();
+            if (!concatenateMany(vm, count))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
         case OP_SUBTRACT:
             BINARY_OP(NUMBER_VAL, -);
             break;
@@ -240,67 +534,203 @@ static InterpretResult run()
             BINARY_OP(NUMBER_VAL, /);
             break;
         case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
             break;
         case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            if (!IS_NUMBER(peek(vm, 0)))
             {
-                runtimeError("Operand must be a number.");
+                STORE_IP();
+                runtimeError(vm, "Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
             break;
         case OP_PRINT:
-            printValue(pop());
-            printf("\n");
+            printLine(&vm->output, pop(vm));
             break;
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-                vm.ip += offset;
+            if (isFalsey(peek(vm, 0)))
+            {
+                TRANSFER(ip - 3, ip + offset);
+                ip += offset;
+            }
             break;
         }
         case OP_JUMP:
         {
             uint16_t offset = READ_SHORT();
-            vm.ip += offset;
+            TRANSFER(ip - 3, ip + offset);
+            ip += offset;
             break;
         }
         case OP_LOOP:
         {
             uint16_t offset = READ_SHORT();
-            vm.ip -= offset;
+            TRANSFER(ip - 3, ip - offset);
+            ip -= offset;
+
+            // Backward branches are one of the two ways to keep the
+            // VM running forever, so we charge fuel here. The ip
+            // already points at the loop head, which is where
+            // resume() picks up again.
+            CHARGE_FUEL(offset);
+            break;
+        }
+        case OP_CALL:
+        {
+            int argCount = READ_BYTE();
+            STORE_IP();
+            if (!callValue(vm, peek(vm, argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+
+            if (vm->fiber->state != FIBER_RUNNING)
+            {
+                // Rewind to this OP_CALL so the native gets to
+                // finish once the fiber is woken up again.
+                vm->ip -= 2;
+                switchFiber(vm);
+                TRANSFER(ip - 2, vm->ip);
+                LOAD_IP();
+            }
+
+            // The other one: there are no Lox functions to recurse
+            // into, but fibers sharing a global can start each other
+            // without end. Each call is charged its two bytes.
+            CHARGE_FUEL(2);
             break;
         }
         case OP_RETURN:
-            return INTERPRET_OK;
+            // A script is only done once all of its fibers are.
+            STORE_IP();
+            if (!finishFiber(vm))
+                return INTERPRET_OK;
+            TRANSFER(ip - 1, vm->ip);
+            LOAD_IP();
+            break;
         }
     }
 
 #undef BINARY_OP
+#undef CHARGE_FUEL
+#undef TRANSFER
+#undef PUBLISH_TRANSFERS
+#undef LOAD_IP
+#undef STORE_IP
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_BYTE // Remove all defined macros
 }
 
-InterpretResult interpret(const char *source)
+static InterpretResult run(VM *vm)
 {
-    Chunk chunk;
-    initChunk(&chunk);
+    return dispatch(vm, false, false, false);
+}
 
-    if (!compile(source, &chunk))
+// For --post-mortem, noting down control transfers, see history.h
+static InterpretResult runRecorded(VM *vm)
+{
+    return dispatch(vm, false, false, true);
+}
+
+// Publishes the ip of every instruction for the sampler, see
+// sampler.h. A store per taken branch is nothing next to that, so it
+// keeps the history too.
+static InterpretResult runSampled(VM *vm)
+{
+    InterpretResult res = dispatch(vm, true, false, true);
+    vm->sampleIp = NULL;
+    return res;
+}
+
+// For --trace, keeping the sampler fed and the history too in case
+// they're on
+static InterpretResult runTraced(VM *vm)
+{
+    InterpretResult res = dispatch(vm, true, true, true);
+    vm->sampleIp = NULL;
+    return res;
+}
+
+// Compile `source` and leave it suspended at its first
+// instruction, ready for resume().
+InterpretResult loadScript(VM *vm, const char *source)
+{
+    // A new script replaces one that is still suspended.
+#ifdef PROFILE_OPCODES
+    finishProfile(&vm->profile);
+#endif
+    freeChunk(&vm->script);
+    vm->chunk = NULL;
+    resetFibers(vm);
+
+    traceBegin("compile");
+    beginPhase(PHASE_COMPILE);
+    bool compiled = compile(vm, source, &vm->script);
+    endPhase(PHASE_COMPILE);
+    traceEnd("compile");
+    if (!compiled)
     {
-        freeChunk(&chunk);
+        freeChunk(&vm->script);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = chunk.code;
+    startRootFiber(vm, &vm->script);
+#ifdef PROFILE_OPCODES
+    startProfile(&vm->profile, &vm->script);
+#endif
+    return INTERPRET_OK;
+}
+
+InterpretResult interpret(VM *vm, const char *source)
+{
+    InterpretResult res = loadScript(vm, source);
+    if (res != INTERPRET_OK)
+        return res;
+
+    return resume(vm);
+}
+
+// Continue a script that returned INTERPRET_YIELD with a fresh
+// budget. The chunk, ip and stack are left untouched on a yield.
+InterpretResult resume(VM *vm)
+{
+    if (vm->chunk == NULL)
+        return INTERPRET_OK;
+
+    startSlice(vm);
+    VM *outer = swapRunningVM(vm);
+    traceBegin("run");
+    beginPhase(PHASE_RUN);
+    InterpretResult res = vm->traceExecution   ? runTraced(vm)
+                          : vm->sampling       ? runSampled(vm)
+                          : vm->history.record ? runRecorded(vm)
+                                               : run(vm);
+    endPhase(PHASE_RUN);
+    traceCounter("stack", vm->stackTop - vm->stack);
+    traceEnd("run");
+    swapRunningVM(outer);
+
+    // Control goes back to the host, and so does the output unless
+    // it asked to have it all at the end
+    if (vm->output.policy != FLUSH_EXIT)
+        flushOutput(&vm->output);
 
-    InterpretResult res = run();
-    freeChunk(&chunk);
+    if (res == INTERPRET_YIELD)
+        return res;
 
+    resetFibers(vm);
+#ifdef PROFILE_OPCODES
+    finishProfile(&vm->profile);
+#endif
+    freeChunk(&vm->script);
+    vm->chunk = NULL;
     return res;
+}
+
+bool isSuspended(VM *vm)
+{
+    return vm->chunk != NULL;
 }
\ No newline at end of file
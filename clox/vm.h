@@ -2,12 +2,20 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "fiber.h"
+#include "history.h"
+#include "output.h"
+#include "profile.h"
 #include "value.h"
 #include "table.h"
 
-#define STACK_MAX 256
+// Fuel is charged at backward branches and calls in units of
+// bytecode bytes. It is handed out in slices so that the hot
+// `OP_LOOP` path only decrements a counter; the budget and the wall-clock
+// deadline are only looked at once a slice runs out.
+#define FUEL_SLICE (64 * 1024)
 
-typedef struct
+struct VM
 /*
 Components:
     - chunk: target chunk to execute
@@ -16,30 +24,78 @@ Components:
           store a local integer.
     - stack: the stack storing the Value
     - stackTop: the top of the stack
+    (The four above are the registers of the running fiber.)
+    - root: the fiber running the script itself
+    - fiber: the running fiber
+    - loop: ready queue, timers and epoll set of the fibers
+    - script: the chunk being run, kept alive while suspended
+    - fuel: remaining bytes in the current fuel slice
+    - budget: remaining fuel for this slice of execution, -1 for unlimited
+    - deadline: monotonic deadline in nanoseconds, 0 for none
+    - output: where `print` goes
+    - history: control transfers of the last instructions, see history.h
+    - profile: opcode counts and timings, PROFILE_OPCODES builds only
+    - sampling: whether the SIGPROF sampler is watching this VM
+    - sampleIp: ip of the running instruction while sampling, else NULL
+    - disassemble: print every chunk once it's compiled
+    - traceExecution: print each instruction and the stack before it
+      runs, for the lines from traceFirstLine to traceLastLine
 */
 {
     Chunk *chunk;
     uint8_t *ip;
-    Value stack[STACK_MAX]; // For storing values
+    Value *stack; // For storing values
     Value *stackTop;
     Obj *objects;  // For garbage collection
-    Table strings; // For interning strings
+    Table strings; // Strings this VM holds a reference to, see intern.h
     Table globals; // For storing global vars
-} VM;
+
+    Fiber root;
+    Fiber *fiber;
+    EventLoop loop;
+
+    Chunk script;
+    int64_t fuel;
+    int64_t budget;
+    int64_t deadline;
+    int64_t fuelLimit;   // Fuel handed to each interpret() / resume()
+    int64_t timeLimitNs; // Time handed to each interpret() / resume()
+
+    Output output;
+    History history;
+#ifdef PROFILE_OPCODES
+    OpProfile profile;
+#endif
+    bool sampling;
+    const uint8_t *volatile sampleIp; // Read from a signal handler
+
+    bool disassemble;
+    bool traceExecution;
+    int traceFirstLine;
+    int traceLastLine;
+};
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD, // Budget or deadline exhausted, call resume()
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop();
+// There is no global VM. Every piece of interpreter state hangs
+// off the `VM *` passed in, so separate VMs can run on separate
+// threads as long as each one is only used by one thread at a time.
+void initVM(VM *vm);
+void freeVM(VM *vm);
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult loadScript(VM *vm, const char *source);
+InterpretResult resume(VM *vm);
+bool isSuspended(VM *vm);
+void setBudget(VM *vm, int64_t fuel, int64_t timeoutMs);
+void setDiagnostics(VM *vm, bool disassemble, bool trace, int firstLine, int lastLine);
+void runtimeError(VM *vm, const char *format, ...);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
 
 #endif